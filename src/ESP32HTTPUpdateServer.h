@@ -3,14 +3,24 @@
 
 /*
   Based on the HTTP update exemple of ESP32 core
+
+  The uploaded chunks (~1.4 KB) are gathered in two flash sector sized buffers. A full buffer is
+  written to flash by a writer task while the next one is being received.
 */
 
 #include <WebServer.h>
 #include <Update.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <algorithm>
 
 #define ESP32_WEB_UPDATE_HTML "<html><body><form method='POST' action='' enctype='multipart/form-data'><input type='file' name='update'><input type='submit' value='Update'></form></body></html>"
 #define ESP32_WEB_UPDATE_SUCCESS_RESPONSE "<META http-equiv=\"refresh\" content=\"10;URL=/\">Update Success! Rebooting...\n"
 
+#define ESP32_WEB_UPDATE_BLOCK_SIZE 4096 // Flash sector size
+#define ESP32_WEB_UPDATE_WRITER_STOP 0xFF
+
 class ESP32HTTPUpdateServer
 {
 private:
@@ -20,12 +30,131 @@ private:
   String _password;
   bool _serialDebugging;
 
+  // Double buffered flash writer
+  uint8_t* _blocks[2];
+  size_t _blockLength[2];
+  uint8_t _fillingBlock; // Index of the block being filled with the received chunks
+  QueueHandle_t _fullBlockQueue; // Blocks to be written by the writer task
+  QueueHandle_t _freeBlockQueue; // Blocks written, ready to be filled again
+  bool _writerRunning;
+
+  bool startWriter()
+  {
+    _blocks[0] = (uint8_t*)malloc(ESP32_WEB_UPDATE_BLOCK_SIZE);
+    _blocks[1] = (uint8_t*)malloc(ESP32_WEB_UPDATE_BLOCK_SIZE);
+    _fullBlockQueue = xQueueCreate(2, sizeof(uint8_t));
+    _freeBlockQueue = xQueueCreate(2, sizeof(uint8_t));
+
+    if (_blocks[0] == NULL || _blocks[1] == NULL || _fullBlockQueue == NULL || _freeBlockQueue == NULL ||
+      xTaskCreate(writerTask, "HTTPUpdateWriter", 4096, this, 1, NULL) != pdPASS)
+    {
+      releaseWriter();
+      return false;
+    }
+
+    _blockLength[0] = 0;
+    _blockLength[1] = 0;
+    _fillingBlock = 0;
+
+    uint8_t freeBlock = 1;
+    xQueueSend(_freeBlockQueue, &freeBlock, portMAX_DELAY);
+
+    _writerRunning = true;
+    return true;
+  }
+
+  // Copy a received chunk, a full block is handed to the writer task
+  void writeChunk(const uint8_t* data, size_t length)
+  {
+    while (length > 0)
+    {
+      size_t copyLength = std::min(length, (size_t)(ESP32_WEB_UPDATE_BLOCK_SIZE - _blockLength[_fillingBlock]));
+      memcpy(_blocks[_fillingBlock] + _blockLength[_fillingBlock], data, copyLength);
+      _blockLength[_fillingBlock] += copyLength;
+      data += copyLength;
+      length -= copyLength;
+
+      if (_blockLength[_fillingBlock] == ESP32_WEB_UPDATE_BLOCK_SIZE)
+      {
+        xQueueSend(_fullBlockQueue, &_fillingBlock, portMAX_DELAY);
+
+        // Wait for the other block to be written, if it is not already
+        xQueueReceive(_freeBlockQueue, &_fillingBlock, portMAX_DELAY);
+        _blockLength[_fillingBlock] = 0;
+      }
+    }
+  }
+
+  // Write the last partial block and wait for the writer task to finish
+  void stopWriter(bool flush)
+  {
+    if (!_writerRunning)
+      return;
+
+    if (flush && _blockLength[_fillingBlock] > 0)
+      xQueueSend(_fullBlockQueue, &_fillingBlock, portMAX_DELAY);
+
+    uint8_t block = ESP32_WEB_UPDATE_WRITER_STOP;
+    xQueueSend(_fullBlockQueue, &block, portMAX_DELAY);
+
+    do
+      xQueueReceive(_freeBlockQueue, &block, portMAX_DELAY);
+    while (block != ESP32_WEB_UPDATE_WRITER_STOP);
+
+    _writerRunning = false;
+    releaseWriter();
+  }
+
+  void releaseWriter()
+  {
+    free(_blocks[0]);
+    free(_blocks[1]);
+    _blocks[0] = NULL;
+    _blocks[1] = NULL;
+
+    if (_fullBlockQueue != NULL)
+      vQueueDelete(_fullBlockQueue);
+    if (_freeBlockQueue != NULL)
+      vQueueDelete(_freeBlockQueue);
+    _fullBlockQueue = NULL;
+    _freeBlockQueue = NULL;
+  }
+
+  static void writerTask(void* parameter)
+  {
+    ESP32HTTPUpdateServer* self = (ESP32HTTPUpdateServer*)parameter;
+    uint8_t block;
+
+    while (true)
+    {
+      xQueueReceive(self->_fullBlockQueue, &block, portMAX_DELAY);
+
+      if (block == ESP32_WEB_UPDATE_WRITER_STOP)
+        break;
+
+      if (Update.write(self->_blocks[block], self->_blockLength[block]) != self->_blockLength[block] && self->_serialDebugging)
+        Update.printError(Serial);
+
+      xQueueSend(self->_freeBlockQueue, &block, portMAX_DELAY);
+    }
+
+    xQueueSend(self->_freeBlockQueue, &block, portMAX_DELAY);
+    vTaskDelete(NULL);
+  }
+
 public:
   ESP32HTTPUpdateServer(bool serialDebugging = false)
   {
+    _serialDebugging = serialDebugging;
     _server = NULL;
     _username = "";
     _password = "";
+
+    _blocks[0] = NULL;
+    _blocks[1] = NULL;
+    _fullBlockQueue = NULL;
+    _freeBlockQueue = NULL;
+    _writerRunning = false;
   }
 
   void setup(WebServer* server, const char* path = "/", const char* username = "", const char* password = "")
@@ -73,17 +202,26 @@ public:
         }
 
         // Starting update
-        bool error = Update.begin(UPDATE_SIZE_UNKNOWN);
-        if (_serialDebugging && error)
+        stopWriter(false);
+        bool success = Update.begin(UPDATE_SIZE_UNKNOWN);
+        if (_serialDebugging && !success)
           Update.printError(Serial);
+        else if (success && !startWriter())
+        {
+          if (_serialDebugging)
+            Serial.printf("Update: Cannot start the flash writer\n");
+          Update.abort();
+        }
       }
       else if (upload.status == UPLOAD_FILE_WRITE) 
       {
-        if (Update.write(upload.buf, upload.currentSize) != upload.currentSize && _serialDebugging) 
-          Update.printError(Serial);
+        if (_writerRunning)
+          writeChunk(upload.buf, upload.currentSize);
       }
       else if (upload.status == UPLOAD_FILE_END) 
       {
+        stopWriter(true);
+
         if (Update.end(true) && _serialDebugging)
           Serial.printf("Update Success: %u\nRebooting...\n", upload.totalSize);
         else if(_serialDebugging)
@@ -92,8 +230,14 @@ public:
         if(_serialDebugging)
           Serial.setDebugOutput(false);
       }
-      else if(_serialDebugging)
-        Serial.printf("Update Failed Unexpectedly (likely broken connection): status=%d\n", upload.status);
+      else
+      {
+        stopWriter(false);
+        Update.abort();
+
+        if(_serialDebugging)
+          Serial.printf("Update Failed Unexpectedly (likely broken connection): status=%d\n", upload.status);
+      }
     });
 
     _server->begin();
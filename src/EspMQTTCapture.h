@@ -0,0 +1,424 @@
+#ifndef ESP_MQTT_CAPTURE_H
+#define ESP_MQTT_CAPTURE_H
+
+/*
+  Wire level capture of the MQTT traffic, and its replay.
+  Enabled with the ESP_MQTT_CLIENT_ENABLE_CAPTURE build flag.
+
+  EspMQTTCaptureClient wraps the transport client used by PubSubClient and records each MQTT packet,
+  in both directions, in a RAM ring buffer and/or to any Print (e.g. a file on SPIFFS / LittleFS).
+  EspMQTTReplayClient is a transport client that plays the inbound packets of a capture back, with
+  the original timing or faster, so the dispatch and the callbacks can be run against real traffic.
+
+  Capture format (little endian):
+    header : "EMQC" + version (1 byte)
+    records: timestamp in millis (4 bytes), direction (1 byte, see EspMQTTCaptureDirection),
+             packet length (2 bytes), packet
+*/
+
+#ifdef ESP_MQTT_CLIENT_ENABLE_CAPTURE
+
+#include <Arduino.h>
+#include <Client.h>
+#include <vector>
+#include <algorithm>
+
+// Size of the RAM ring buffer, the oldest packets are dropped when it is full
+#ifndef ESP_MQTT_CLIENT_CAPTURE_SIZE
+  #define ESP_MQTT_CLIENT_CAPTURE_SIZE 4096
+#endif
+
+#define ESP_MQTT_CAPTURE_VERSION 1
+#define ESP_MQTT_CAPTURE_RECORD_HEADER_SIZE 7
+
+enum EspMQTTCaptureDirection : uint8_t {
+  CAPTURE_INBOUND = 0, // From the broker
+  CAPTURE_OUTBOUND = 1 // To the broker
+};
+
+class EspMQTTCaptureClient : public Client
+{
+private:
+  // Rebuild the MQTT packets from the bytes read or written (fixed header, remaining length, rest of the packet)
+  struct PacketFramer {
+    std::vector<uint8_t> packet;
+    uint32_t remainingLength;
+    bool remainingLengthComplete;
+    uint32_t startMillis;
+  };
+
+  Client* _client;
+  Print* _output;
+  PacketFramer _framers[2]; // Indexed by direction
+
+  uint8_t _ring[ESP_MQTT_CLIENT_CAPTURE_SIZE];
+  size_t _ringTail; // Oldest record
+  size_t _ringUsed;
+  unsigned long _droppedPacketCount;
+
+public:
+  EspMQTTCaptureClient() : _client(NULL), _output(NULL), _ringTail(0), _ringUsed(0), _droppedPacketCount(0)
+  {
+    resetFramer(_framers[CAPTURE_INBOUND]);
+    resetFramer(_framers[CAPTURE_OUTBOUND]);
+  }
+
+  // output: optional, also write the capture there as it is recorded
+  void begin(Client &client, Print* output = NULL)
+  {
+    _client = &client;
+    _output = output;
+
+    if (_output != NULL)
+      writeHeader(*_output);
+  }
+
+  inline void setClient(Client &client) { _client = &client; };
+
+  // Write the RAM capture, oldest packet first
+  void dump(Print &output)
+  {
+    writeHeader(output);
+
+    size_t firstPartLength = std::min(_ringUsed, (size_t)ESP_MQTT_CLIENT_CAPTURE_SIZE - _ringTail);
+    output.write(_ring + _ringTail, firstPartLength);
+    output.write(_ring, _ringUsed - firstPartLength);
+  }
+
+  void clear()
+  {
+    _ringTail = 0;
+    _ringUsed = 0;
+    _droppedPacketCount = 0;
+  }
+
+  // Packets that did not fit in the RAM ring buffer
+  inline unsigned long getDroppedPacketCount() const { return _droppedPacketCount; };
+
+  // Client interface, forwarded to the wrapped client
+  int connect(IPAddress ip, uint16_t port) override
+  {
+    resetFramer(_framers[CAPTURE_INBOUND]);
+    resetFramer(_framers[CAPTURE_OUTBOUND]);
+    return _client->connect(ip, port);
+  }
+
+  int connect(const char* host, uint16_t port) override
+  {
+    resetFramer(_framers[CAPTURE_INBOUND]);
+    resetFramer(_framers[CAPTURE_OUTBOUND]);
+    return _client->connect(host, port);
+  }
+
+  #ifdef ESP32
+    // Added to Client by the ESP32 core 3
+    int connect(IPAddress ip, uint16_t port, int32_t timeout) { return connect(ip, port); }
+    int connect(const char* host, uint16_t port, int32_t timeout) { return connect(host, port); }
+  #endif
+
+  size_t write(uint8_t byte) override
+  {
+    return write(&byte, 1);
+  }
+
+  size_t write(const uint8_t* buffer, size_t size) override
+  {
+    size_t written = _client->write(buffer, size);
+    for (size_t i = 0; i < written; i++)
+      capture(CAPTURE_OUTBOUND, buffer[i]);
+    return written;
+  }
+
+  int read() override
+  {
+    int byte = _client->read();
+    if (byte >= 0)
+      capture(CAPTURE_INBOUND, byte);
+    return byte;
+  }
+
+  int read(uint8_t* buffer, size_t size) override
+  {
+    int length = _client->read(buffer, size);
+    for (int i = 0; i < length; i++)
+      capture(CAPTURE_INBOUND, buffer[i]);
+    return length;
+  }
+
+  int available() override { return _client->available(); }
+  int peek() override { return _client->peek(); }
+  void flush() override { _client->flush(); }
+  void stop() override { _client->stop(); }
+  uint8_t connected() override { return _client->connected(); }
+  operator bool() override { return _client != NULL && (bool)*_client; }
+
+private:
+  static void resetFramer(PacketFramer &framer)
+  {
+    framer.packet.clear();
+    framer.remainingLength = 0;
+    framer.remainingLengthComplete = false;
+  }
+
+  void capture(EspMQTTCaptureDirection direction, uint8_t byte)
+  {
+    PacketFramer &framer = _framers[direction];
+
+    framer.packet.push_back(byte);
+    if (framer.packet.size() == 1)
+    {
+      framer.startMillis = millis();
+      return;
+    }
+
+    // Remaining length: 1 to 4 bytes, 7 bits each
+    if (!framer.remainingLengthComplete)
+    {
+      framer.remainingLength |= (uint32_t)(byte & 0x7F) << (7 * (framer.packet.size() - 2));
+      framer.remainingLengthComplete = !(byte & 0x80) || framer.packet.size() == 5;
+    }
+    else
+      framer.remainingLength--;
+
+    if (framer.remainingLengthComplete && framer.remainingLength == 0)
+    {
+      if (direction == CAPTURE_OUTBOUND && (framer.packet[0] & 0xF0) == 0x10)
+        redactConnectPassword(framer.packet);
+
+      record(direction, framer.startMillis, framer.packet.data(), framer.packet.size());
+      resetFramer(framer);
+    }
+  }
+
+  // The capture is taken above TLS: blank out the password of the CONNECT packet so the broker
+  // credentials are neither kept in RAM nor written to the output.
+  // If the packet can't be parsed, its whole variable header and payload are blanked.
+  static void redactConnectPassword(std::vector<uint8_t> &packet)
+  {
+    size_t position = 1;
+    while (position < packet.size() && (packet[position] & 0x80))
+      position++;
+    position++; // Last byte of the remaining length
+
+    size_t variableHeaderStart = position;
+
+    // Protocol name, level, flags and keep alive
+    size_t fieldLength;
+    bool parsed = skipConnectField(packet, position, fieldLength) && position + 4 <= packet.size();
+    uint8_t flags = parsed ? packet[position + 1] : 0;
+    position += 4;
+
+    // Payload: client id, will topic and message, username, password
+    parsed = parsed && skipConnectField(packet, position, fieldLength);
+    if (flags & 0x04)
+      parsed = parsed && skipConnectField(packet, position, fieldLength) && skipConnectField(packet, position, fieldLength);
+    if (flags & 0x80)
+      parsed = parsed && skipConnectField(packet, position, fieldLength);
+
+    if (parsed && (flags & 0x40))
+    {
+      parsed = skipConnectField(packet, position, fieldLength);
+      if (parsed)
+        std::fill(packet.begin() + (position - fieldLength), packet.begin() + position, '*');
+    }
+
+    if (!parsed)
+      std::fill(packet.begin() + std::min(variableHeaderStart, packet.size()), packet.end(), 0);
+  }
+
+  // Skip a length prefixed field, return false if it goes beyond the packet
+  static bool skipConnectField(const std::vector<uint8_t> &packet, size_t &position, size_t &fieldLength)
+  {
+    if (position + 2 > packet.size())
+      return false;
+
+    fieldLength = (packet[position] << 8) | packet[position + 1];
+    if (position + 2 + fieldLength > packet.size())
+      return false;
+
+    position += 2 + fieldLength;
+    return true;
+  }
+
+  void record(EspMQTTCaptureDirection direction, uint32_t timestamp, const uint8_t* packet, size_t length)
+  {
+    if (length > 0xFFFF)
+    {
+      _droppedPacketCount++;
+      return;
+    }
+
+    uint8_t header[ESP_MQTT_CAPTURE_RECORD_HEADER_SIZE] = {
+      (uint8_t)timestamp, (uint8_t)(timestamp >> 8), (uint8_t)(timestamp >> 16), (uint8_t)(timestamp >> 24),
+      (uint8_t)direction,
+      (uint8_t)length, (uint8_t)(length >> 8)
+    };
+
+    if (_output != NULL)
+    {
+      _output->write(header, sizeof(header));
+      _output->write(packet, length);
+    }
+
+    size_t recordSize = sizeof(header) + length;
+    if (recordSize > ESP_MQTT_CLIENT_CAPTURE_SIZE)
+    {
+      _droppedPacketCount++;
+      return;
+    }
+
+    // Drop the oldest records until the new one fits
+    while (ESP_MQTT_CLIENT_CAPTURE_SIZE - _ringUsed < recordSize)
+    {
+      size_t oldestLength = _ring[(_ringTail + 5) % ESP_MQTT_CLIENT_CAPTURE_SIZE] | (_ring[(_ringTail + 6) % ESP_MQTT_CLIENT_CAPTURE_SIZE] << 8);
+      _ringTail = (_ringTail + ESP_MQTT_CAPTURE_RECORD_HEADER_SIZE + oldestLength) % ESP_MQTT_CLIENT_CAPTURE_SIZE;
+      _ringUsed -= ESP_MQTT_CAPTURE_RECORD_HEADER_SIZE + oldestLength;
+      _droppedPacketCount++;
+    }
+
+    ringWrite(header, sizeof(header));
+    ringWrite(packet, length);
+  }
+
+  void ringWrite(const uint8_t* data, size_t length)
+  {
+    size_t head = (_ringTail + _ringUsed) % ESP_MQTT_CLIENT_CAPTURE_SIZE;
+    size_t firstPartLength = std::min(length, (size_t)ESP_MQTT_CLIENT_CAPTURE_SIZE - head);
+
+    memcpy(_ring + head, data, firstPartLength);
+    memcpy(_ring, data + firstPartLength, length - firstPartLength);
+    _ringUsed += length;
+  }
+
+  static void writeHeader(Print &output)
+  {
+    const uint8_t header[] = { 'E', 'M', 'Q', 'C', ESP_MQTT_CAPTURE_VERSION };
+    output.write(header, sizeof(header));
+  }
+};
+
+// Transport client playing back the inbound packets of a capture, the outbound ones are discarded.
+// Use it with EspMQTTClient::setTransportClient(). The replay ends with a disconnection when the capture is exhausted.
+class EspMQTTReplayClient : public Client
+{
+private:
+  Stream* _capture;
+  float _speed; // 1 for the original timing, 2 for twice faster, 0 for no delay at all
+  bool _connected;
+  bool _exhausted;
+  unsigned long _connectMillis;
+  bool _firstRecordRead;
+  uint32_t _firstRecordMillis;
+  uint32_t _recordMillis;
+  uint16_t _recordRemaining; // Bytes of the current inbound packet left to be read
+
+public:
+  // capture: positionned at the beginning of the capture (e.g. a file opened in read mode)
+  EspMQTTReplayClient(Stream &capture, float speed = 1) :
+    _capture(&capture), _speed(speed), _connected(false), _exhausted(true), _connectMillis(0),
+    _firstRecordRead(false), _firstRecordMillis(0), _recordMillis(0), _recordRemaining(0) {}
+
+  int connect(IPAddress ip, uint16_t port) override
+  {
+    return connect((const char*)NULL, port);
+  }
+
+  int connect(const char* host, uint16_t port) override
+  {
+    uint8_t header[5];
+    if (_capture->readBytes(header, sizeof(header)) != sizeof(header) || memcmp(header, "EMQC", 4) != 0 || header[4] != ESP_MQTT_CAPTURE_VERSION)
+      return 0;
+
+    _connected = true;
+    _exhausted = false;
+    _connectMillis = millis();
+    _firstRecordRead = false;
+    _recordRemaining = 0;
+    return 1;
+  }
+
+  #ifdef ESP32
+    // Added to Client by the ESP32 core 3
+    int connect(IPAddress ip, uint16_t port, int32_t timeout) { return connect(ip, port); }
+    int connect(const char* host, uint16_t port, int32_t timeout) { return connect(host, port); }
+  #endif
+
+  size_t write(uint8_t byte) override { return _connected ? 1 : 0; }
+  size_t write(const uint8_t* buffer, size_t size) override { return _connected ? size : 0; }
+
+  // Bytes of the current inbound packet, once its time has come
+  int available() override
+  {
+    if (!_connected || (_recordRemaining == 0 && !loadNextInboundRecord()))
+      return 0;
+
+    if (_speed > 0 && (millis() - _connectMillis) * _speed < _recordMillis - _firstRecordMillis)
+      return 0;
+
+    return std::min((int)_recordRemaining, _capture->available());
+  }
+
+  int read() override
+  {
+    if (available() <= 0)
+      return -1;
+
+    _recordRemaining--;
+    return _capture->read();
+  }
+
+  int read(uint8_t* buffer, size_t size) override
+  {
+    size_t length = std::min(size, (size_t)std::max(available(), 0));
+    length = _capture->readBytes(buffer, length);
+    _recordRemaining -= length;
+    return length;
+  }
+
+  int peek() override { return available() > 0 ? _capture->peek() : -1; }
+  void flush() override {}
+  void stop() override { _connected = false; }
+  uint8_t connected() override { return _connected && !(_exhausted && _recordRemaining == 0); }
+  operator bool() override { return connected(); }
+
+private:
+  bool loadNextInboundRecord()
+  {
+    uint8_t header[ESP_MQTT_CAPTURE_RECORD_HEADER_SIZE];
+
+    while (!_exhausted)
+    {
+      if (_capture->readBytes(header, sizeof(header)) != sizeof(header))
+      {
+        _exhausted = true;
+        break;
+      }
+
+      uint32_t timestamp = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+      uint16_t length = header[5] | (header[6] << 8);
+
+      if (!_firstRecordRead)
+      {
+        _firstRecordMillis = timestamp;
+        _firstRecordRead = true;
+      }
+
+      if (header[4] == CAPTURE_INBOUND && length > 0)
+      {
+        _recordMillis = timestamp;
+        _recordRemaining = length;
+        return true;
+      }
+
+      // Outbound packets are generated again by the client
+      for (uint16_t i = 0; i < length; i++)
+        _capture->read();
+    }
+
+    return false;
+  }
+};
+
+#endif
+
+#endif
@@ -1,4 +1,55 @@
 #include "EspMQTTClient.h"
+#include <math.h>
+#include <algorithm>
+
+#ifdef ESP8266
+  // Position (in blocks of 4 bytes) of the library state in the RTC user memory.
+  // The first blocks are left free for the sketch.
+  #ifndef ESP_MQTT_CLIENT_RTC_OFFSET
+    #define ESP_MQTT_CLIENT_RTC_OFFSET 64
+  #endif
+#else
+  // Survive a deep sleep, but not a power loss.
+  RTC_DATA_ATTR static uint8_t rtcStateStorage[64];
+#endif
+
+#if (defined(ESP_MQTT_CLIENT_ENABLE_TRACING) || defined(ESP_MQTT_CLIENT_ENABLE_CAPTURE)) && !defined(ESP_MQTT_CLIENT_DISABLE_WEB_UPDATER)
+// Buffer the trace or capture output and send it in chunks through the web server
+class WebServerChunkedPrint : public Print
+{
+private:
+  WebServer* _server;
+  char _buffer[256];
+  size_t _length;
+
+public:
+  WebServerChunkedPrint(WebServer* server) : _server(server), _length(0) {}
+
+  size_t write(uint8_t c) override
+  {
+    _buffer[_length++] = c;
+    if (_length == sizeof(_buffer))
+      sendBuffer();
+    return 1;
+  }
+
+  void sendBuffer()
+  {
+    if (_length > 0)
+      _server->sendContent(_buffer, _length);
+    _length = 0;
+  }
+};
+#endif
+
+// FNV-1a, used for checksums and topic hashes
+static uint32_t fnv1aHash(const uint8_t* data, std::size_t length)
+{
+  uint32_t hash = 2166136261u;
+  for (std::size_t i = 0; i < length; i++)
+    hash = (hash ^ data[i]) * 16777619u;
+  return hash;
+}
 
 
 // =============== Constructor / destructor ===================
@@ -65,6 +116,16 @@ EspMQTTClient::EspMQTTClient(
   _nextWifiConnectionAttemptMillis = 500;
   _lastWifiConnectionAttemptMillis = 0;
   _wifiReconnectionAttemptDelay = 60 * 1000;
+  _wifiFastReconnect = false;
+  _wifiFastReconnectReuseIp = false;
+  _connectingToWifiWithHint = false;
+  _wifiReusedIpLease = false;
+  _wifiFastConnectionTimeout = 3 * 1000;
+  _mqttConnectionDelayAfterWifi = 0; // Raised to 500ms if the broker connection is unstable
+  _firstMqttAttemptAfterWifi = false;
+  _firstPublishMillis = 0;
+  memset(&_rtcState, 0, sizeof(_rtcState));
+  _rtcStateLoaded = false;
 
   // MQTT client
   _mqttConnected = false;
@@ -76,26 +137,129 @@ EspMQTTClient::EspMQTTClient(
   _mqttCleanSession = true;
   _mqttClient.setCallback([this](char* topic, uint8_t* payload, unsigned int length) {this->mqttMessageReceivedCallback(topic, payload, length);});
   _failedMQTTConnectionAttemptCount = 0;
+  _lastMqttConnectionDuration = 0;
+  _transportClient = &_wifiClient;
+
+  // Multiple brokers
+  _mqttServerList.push_back({ mqttServerIp, mqttUsername, mqttPassword, mqttServerPort, {} });
+  _mqttServerIndex = 0;
+  _mqttPreferredServerIndex = 0;
+  _mqttFailoverCount = 0;
+  _mqttServerLatencySelection = false;
+  _mqttFailingBack = false;
+  _mqttFailoverDelay = 500;
+  _mqttFailbackDelay = 5 * 60 * 1000;
+  _mqttConnectedSinceMillis = 0;
+  _mqttDisconnectedSinceMillis = 0;
+
+  // TLS
+  _secureClient = NULL;
+  _tlsFingerprint = NULL;
+  #ifndef ESP8266
+    _tlsConnectAndVerify = NULL;
+  #endif
+  #ifdef ESP8266
+    _tlsSession = NULL;
+    _tlsTrustAnchors = NULL;
+  #endif
+
+  // Inbound queue
+  _inboundQueueBuffer = NULL;
+  _inboundQueuePayloadLengths = NULL;
+  _inboundQueueCapacity = 0;
+  _inboundQueueCount = 0;
+  _inboundQueueEntrySize = 0;
+  _inboundQueueMaxMillis = 0;
+  _inboundOverflowPayloadLength = 0;
+
+  // Publish rate limiting
+  _globalPublishRateLimit = { "", 0, 0, 0, 0, 0, PublishRateLimitMode::Queue };
+  _publishQueueMaxSize = 10;
+  _publishRateLimitCounters = {};
+
+  // Report by exception
+  _reportByExceptionTable = NULL;
+  _reportByExceptionTopics = NULL;
+  _reportByExceptionClock = 0;
+  _reportByExceptionCapacity = 0;
+  _reportByExceptionMaxTopicLength = 0;
+  _reportByExceptionHeartbeat = 0;
+  _suppressedPublishCount = 0;
+
+  // Last value cache
+  _lastValueCacheEntries = NULL;
+  _lastValueCacheData = NULL;
+  _lastValueCacheCapacity = 0;
+  _lastValueCacheMaxTopicLength = 0;
+  _lastValueCacheMaxPayloadLength = 0;
+  _lastValueCacheClock = 0;
+  _lastValueCacheGeneration = 0;
+
+  // RPC
+  _nextRpcCorrelationId = 0;
 
   // HTTP/OTA update related
-  _updateServerAddress = NULL;
-  _httpServer = NULL;
-  _httpUpdater = NULL;
-  _enableOTA = false;
+  #ifndef ESP_MQTT_CLIENT_DISABLE_WEB_UPDATER
+    _updateServerAddress = NULL;
+    _httpServer = NULL;
+    _httpUpdater = NULL;
+    _httpUpdaterSetUp = false;
+  #endif
+  #ifndef ESP_MQTT_CLIENT_DISABLE_OTA
+    _enableOTA = false;
+  #endif
+
+  // Staged startup
+  _startupStage = StartupStage::WiFi;
+  _startupBeginMillis = 0;
+  _startupStageBeginMillis = 0;
+  _servicesStartTimeout = 5 * 1000;
+  memset(&_currentStartupTimings, 0, sizeof(_currentStartupTimings));
+  memset(&_bootTimings, 0, sizeof(_bootTimings));
+  memset(&_reconnectionTimings, 0, sizeof(_reconnectionTimings));
 
   // other
   _enableDebugMessages = false;
   _drasticResetOnConnectionFailures = false;
   _connectionEstablishedCallback = onConnectionEstablished;
   _connectionEstablishedCount = 0;
+
+  // Duty cycle
+  _dutyCycleEnabled = false;
+  _dutyCycleSleepSeconds = 0;
+  _dutyCycleMaxAwakeMillis = 0;
+  _dutyCycleFlushDelay = 100;
+  _dutyCycleSleepMillis = 0;
 }
 
 EspMQTTClient::~EspMQTTClient()
 {
-  if (_httpServer != NULL)
-    delete _httpServer;
-  if (_httpUpdater != NULL)
-    delete _httpUpdater;
+  #ifndef ESP_MQTT_CLIENT_DISABLE_WEB_UPDATER
+    if (_httpServer != NULL)
+      delete _httpServer;
+    if (_httpUpdater != NULL)
+      delete _httpUpdater;
+  #endif
+  if (_secureClient != NULL)
+    delete _secureClient;
+  #ifdef ESP8266
+    if (_tlsSession != NULL)
+      delete _tlsSession;
+    if (_tlsTrustAnchors != NULL)
+      delete _tlsTrustAnchors;
+  #endif
+  if (_reportByExceptionTable != NULL)
+    delete[] _reportByExceptionTable;
+  if (_reportByExceptionTopics != NULL)
+    delete[] _reportByExceptionTopics;
+  if (_lastValueCacheEntries != NULL)
+    delete[] _lastValueCacheEntries;
+  if (_lastValueCacheData != NULL)
+    delete[] _lastValueCacheData;
+  if (_inboundQueueBuffer != NULL)
+    delete[] _inboundQueueBuffer;
+  if (_inboundQueuePayloadLengths != NULL)
+    delete[] _inboundQueuePayloadLengths;
 }
 
 
@@ -106,12 +270,41 @@ void EspMQTTClient::enableDebuggingMessages(const bool enabled)
   _enableDebugMessages = enabled;
 }
 
+#ifndef ESP_MQTT_CLIENT_DISABLE_WEB_UPDATER
 void EspMQTTClient::enableHTTPWebUpdater(const char* username, const char* password, const char* address)
 {
   if (_httpServer == NULL)
   {
     _httpServer = new WebServer(80);
     _httpUpdater = new ESPHTTPUpdateServer(_enableDebugMessages);
+
+    #ifdef ESP_MQTT_CLIENT_ENABLE_TRACING
+      _httpServer->on("/trace", HTTP_GET, [this]() {
+        if (!authenticateWebRequest())
+          return;
+
+        WebServerChunkedPrint output(_httpServer);
+        _httpServer->setContentLength(CONTENT_LENGTH_UNKNOWN);
+        _httpServer->send(200, "application/json", "");
+        EspMQTTTrace::instance().dump(output);
+        output.sendBuffer();
+        _httpServer->sendContent("");
+      });
+    #endif
+    #ifdef ESP_MQTT_CLIENT_ENABLE_CAPTURE
+      _httpServer->on("/capture", HTTP_GET, [this]() {
+        if (!authenticateWebRequest())
+          return;
+
+        WebServerChunkedPrint output(_httpServer);
+        _httpServer->setContentLength(CONTENT_LENGTH_UNKNOWN);
+        _httpServer->sendHeader("Content-Disposition", "attachment; filename=capture.emqc");
+        _httpServer->send(200, "application/octet-stream", "");
+        _captureClient.dump(output);
+        output.sendBuffer();
+        _httpServer->sendContent("");
+      });
+    #endif
     _updateServerUsername = (char*)username;
     _updateServerPassword = (char*)password;
     _updateServerAddress = (char*)address;
@@ -128,6 +321,20 @@ void EspMQTTClient::enableHTTPWebUpdater(const char* address)
     enableHTTPWebUpdater(_mqttUsername, _mqttPassword, address);
 }
 
+// Same credentials as the updater, request them if they are missing or wrong
+bool EspMQTTClient::authenticateWebRequest()
+{
+  if (_updateServerUsername != NULL && _updateServerPassword != NULL && strlen(_updateServerUsername) > 0 && strlen(_updateServerPassword) > 0 && !_httpServer->authenticate(_updateServerUsername, _updateServerPassword))
+  {
+    _httpServer->requestAuthentication();
+    return false;
+  }
+
+  return true;
+}
+#endif
+
+#ifndef ESP_MQTT_CLIENT_DISABLE_OTA
 void EspMQTTClient::enableOTA(const char *password, const uint16_t port)
 {
   _enableOTA = true;
@@ -143,6 +350,7 @@ void EspMQTTClient::enableOTA(const char *password, const uint16_t port)
   if (port)
     ArduinoOTA.setPort(port);
 }
+#endif
 
 void EspMQTTClient::enableMQTTPersistence()
 {
@@ -156,11 +364,140 @@ void EspMQTTClient::enableLastWillMessage(const char* topic, const char* message
   _mqttLastWillRetain = retain;
 }
 
+void EspMQTTClient::enableTLS(const char* fingerprint, const char* caCert)
+{
+  if (_secureClient != NULL)
+  {
+    if (_enableDebugMessages)
+      Serial.print("SYS! You can't call enableTLS() more than once !\n");
+    return;
+  }
+
+  _secureClient = new WiFiClientSecure();
+  _tlsFingerprint = fingerprint;
+
+  #ifdef ESP8266
+    // The session is reused at each reconnection, this skip the full handshake when the broker support it
+    _tlsSession = new BearSSL::Session();
+    _secureClient->setSession(_tlsSession);
+
+    if (caCert != NULL)
+    {
+      _tlsTrustAnchors = new BearSSL::X509List(caCert);
+      _secureClient->setTrustAnchors(_tlsTrustAnchors);
+    }
+    else if (fingerprint != NULL)
+      _secureClient->setFingerprint(fingerprint);
+    else
+      _secureClient->setInsecure();
+  #else
+    if (caCert != NULL)
+      _secureClient->setCACert(caCert);
+    else
+      _secureClient->setInsecure();
+
+    // The fingerprint is checked once the TLS connection is made, before the MQTT connection
+    if (fingerprint != NULL)
+      _tlsConnectAndVerify = &EspMQTTClient::connectAndVerifyTlsServer;
+  #endif
+
+  if (fingerprint == NULL && caCert == NULL && _enableDebugMessages)
+    Serial.print("SYS! TLS enabled without fingerprint or CA certificate, the broker will not be authenticated.\n");
+
+  setTransportClient(*_secureClient);
+}
+
+void EspMQTTClient::enableReportByException(const uint8_t maxTopics, const unsigned long heartbeatMillis, const uint8_t maxTopicLength)
+{
+  if (_reportByExceptionTable == NULL && maxTopics > 0)
+  {
+    _reportByExceptionCapacity = maxTopics;
+    _reportByExceptionMaxTopicLength = maxTopicLength;
+    _reportByExceptionHeartbeat = heartbeatMillis;
+    _reportByExceptionTable = new ReportByExceptionRecord[maxTopics]();
+    _reportByExceptionTopics = new char[maxTopics * (maxTopicLength + 1)];
+  }
+  else if (_enableDebugMessages)
+    Serial.print("SYS! You can't call enableReportByException() more than once !\n");
+}
+
+void EspMQTTClient::enableInboundQueue(const uint8_t maxMessagesPerLoop, const uint16_t maxMessageSize, const unsigned int maxMillisPerLoop)
+{
+  if (_inboundQueueBuffer == NULL && maxMessagesPerLoop > 0)
+  {
+    _inboundQueueCapacity = maxMessagesPerLoop;
+    _inboundQueueEntrySize = maxMessageSize + 2; // Room for the topic and payload termination characters
+    _inboundQueueMaxMillis = maxMillisPerLoop;
+    _inboundQueueBuffer = new uint8_t[_inboundQueueCapacity * _inboundQueueEntrySize];
+    _inboundQueuePayloadLengths = new uint16_t[_inboundQueueCapacity];
+  }
+  else if (_enableDebugMessages)
+    Serial.print("SYS! You can't call enableInboundQueue() more than once !\n");
+}
+
+void EspMQTTClient::enableLastValueCache(const uint8_t maxEntries, const uint8_t maxTopicLength, const uint16_t maxPayloadLength)
+{
+  if (_lastValueCacheEntries == NULL && maxEntries > 0)
+  {
+    _lastValueCacheCapacity = maxEntries;
+    _lastValueCacheMaxTopicLength = maxTopicLength;
+    _lastValueCacheMaxPayloadLength = maxPayloadLength;
+    _lastValueCacheEntries = new LastValueCacheEntry[maxEntries]();
+    _lastValueCacheData = new char[maxEntries * (maxTopicLength + maxPayloadLength + 2)];
+  }
+  else if (_enableDebugMessages)
+    Serial.print("SYS! You can't call enableLastValueCache() more than once !\n");
+}
+
+void EspMQTTClient::enableRPC(const String &replyTopic, const uint8_t maxPendingCalls)
+{
+  _rpcReplyTopic = replyTopic;
+  _pendingRpcList.resize(maxPendingCalls);
+}
+
+void EspMQTTClient::enableDutyCycle(const unsigned long sleepSeconds, const unsigned long maxAwakeMillis)
+{
+  _dutyCycleEnabled = true;
+  _dutyCycleSleepSeconds = sleepSeconds;
+  _dutyCycleMaxAwakeMillis = maxAwakeMillis;
+
+  // Each wake up must connect as fast as possible
+  if (!_wifiFastReconnect)
+    enableWifiFastReconnect();
+  else
+    loadRtcState();
+
+  _rtcState.dutyCycleCount++;
+
+  if (_enableDebugMessages)
+    Serial.printf("SYS: Wake up #%lu, previous cycle was awake for %lums\n", (unsigned long)_rtcState.dutyCycleCount, (unsigned long)_rtcState.lastAwakeMillis);
+}
+
+void EspMQTTClient::enableWifiFastReconnect(const bool reuseIpLease)
+{
+  _wifiFastReconnect = true;
+  _wifiFastReconnectReuseIp = reuseIpLease;
+
+  // With a valid hint, we start from the settle delay that worked the last time
+  if (loadRtcState() && _rtcState.channel != 0)
+  {
+    _mqttConnectionDelayAfterWifi = _rtcState.mqttConnectionDelayAfterWifi;
+
+    if (_enableDebugMessages)
+      Serial.printf("WiFi: Fast reconnection hint found, channel %u\n", _rtcState.channel);
+  }
+}
+
 
 // =============== Main loop / connection state handling =================
 
 void EspMQTTClient::loop()
 {
+  ESP_MQTT_TRACE_SCOPE("loop");
+
+  if (_dutyCycleEnabled)
+    handleDutyCycle();
+
   bool wifiStateChanged = handleWiFi();
 
   // If there is a change in the wifi connection state, don't handle the mqtt connection state right away.
@@ -173,7 +510,12 @@ void EspMQTTClient::loop()
   if(mqttStateChanged)
     return;
 
+  if (_startupStage != StartupStage::Done)
+    handleStartup();
+
+  processPublishQueue();
   processDelayedExecutionRequests();
+  processRpcTimeouts();
 }
 
 bool EspMQTTClient::handleWiFi()
@@ -182,8 +524,14 @@ bool EspMQTTClient::handleWiFi()
   static bool firstLoopCall = true;
   if(_handleWiFi && firstLoopCall)
   {
-    WiFi.disconnect(true);
-    _nextWifiConnectionAttemptMillis = millis() + 500;
+    // In fast reconnection mode, we keep the radio on and connect right away
+    if (_wifiFastReconnect)
+      _nextWifiConnectionAttemptMillis = millis() + 1;
+    else
+    {
+      WiFi.disconnect(true);
+      _nextWifiConnectionAttemptMillis = millis() + 500;
+    }
     firstLoopCall = false;
     return true;
   }
@@ -199,24 +547,43 @@ bool EspMQTTClient::handleWiFi()
   {
     onWiFiConnectionEstablished();
     _connectingToWifi = false;
+    _connectingToWifiWithHint = false;
 
-    // At least 500 miliseconds of waiting before an mqtt connection attempt.
     // Some people have reported instabilities when trying to connect to
     // the mqtt broker right after being connected to wifi.
-    // This delay prevent these instabilities.
-    _nextMqttConnectionAttemptMillis = millis() + 500;
+    // This settle delay start at 0 and is raised to 500 miliseconds only if needed.
+    _nextMqttConnectionAttemptMillis = millis() + _mqttConnectionDelayAfterWifi;
+    _firstMqttAttemptAfterWifi = true;
   }
 
   // Connection in progress
   else if(_connectingToWifi)
   {
-      if(WiFi.status() == WL_CONNECT_FAILED || millis() - _lastWifiConnectionAttemptMillis >= _wifiReconnectionAttemptDelay)
+      wl_status_t status = WiFi.status();
+
+      // The fast connection attempt failed, the access point may have moved. We retry with a full scan.
+      if(_connectingToWifiWithHint &&
+        (status == WL_NO_SSID_AVAIL || status == WL_CONNECT_FAILED || millis() - _lastWifiConnectionAttemptMillis >= _wifiFastConnectionTimeout))
+      {
+        if(_enableDebugMessages)
+          Serial.printf("WiFi! Fast connection attempt failed, falling back to a full scan. (%fs). \n", millis()/1000.0);
+
+        clearWifiConnectionHint();
+        WiFi.disconnect();
+
+        _nextWifiConnectionAttemptMillis = millis() + 1;
+        _connectingToWifi = false;
+        _connectingToWifiWithHint = false;
+      }
+      else if(status == WL_CONNECT_FAILED || millis() - _lastWifiConnectionAttemptMillis >= _wifiReconnectionAttemptDelay)
       {
         if(_enableDebugMessages)
           Serial.printf("WiFi! Connection attempt failed, delay expired. (%fs). \n", millis()/1000.0);
 
         WiFi.disconnect(true);
-        MDNS.end();
+        #ifndef ESP_MQTT_CLIENT_DISABLE_WEB_UPDATER
+          MDNS.end();
+        #endif
 
         _nextWifiConnectionAttemptMillis = millis() + 500;
         _connectingToWifi = false;
@@ -236,16 +603,24 @@ bool EspMQTTClient::handleWiFi()
   else if (isWifiConnected && _wifiConnected)
   {
     // Web updater handling
-    if (_httpServer != NULL)
-    {
-      _httpServer->handleClient();
-      #ifdef ESP8266
-        MDNS.update(); // We need to do this only for ESP8266
-      #endif
-    }
+    #ifndef ESP_MQTT_CLIENT_DISABLE_WEB_UPDATER
+      if (_httpServer != NULL && (_startupStage == StartupStage::OTA || _startupStage == StartupStage::Done))
+      {
+        ESP_MQTT_TRACE_SCOPE("httpServer.handleClient");
+        _httpServer->handleClient();
+        #ifdef ESP8266
+          MDNS.update(); // We need to do this only for ESP8266
+        #endif
+      }
+    #endif
 
-    if (_enableOTA)
-      ArduinoOTA.handle();
+    #ifndef ESP_MQTT_CLIENT_DISABLE_OTA
+      if (_enableOTA && _startupStage == StartupStage::Done)
+      {
+        ESP_MQTT_TRACE_SCOPE("ArduinoOTA.handle");
+        ArduinoOTA.handle();
+      }
+    #endif
   }
 
   // Disconnected since at least one loop() call
@@ -273,7 +648,13 @@ bool EspMQTTClient::handleWiFi()
 bool EspMQTTClient::handleMQTT()
 {
   // PubSubClient main loop() call
-  _mqttClient.loop();
+  if (_inboundQueueCapacity > 0)
+    receiveInboundMessages();
+  else
+  {
+    ESP_MQTT_TRACE_SCOPE("mqttClient.loop");
+    _mqttClient.loop();
+  }
 
   // Get the current connextion status
   bool isMqttConnected = (isWifiConnected() && _mqttClient.connected());
@@ -285,6 +666,11 @@ bool EspMQTTClient::handleMQTT()
   if (isMqttConnected && !_mqttConnected)
   {
     _mqttConnected = true;
+    _mqttConnectedSinceMillis = millis();
+
+    if (_startupStage == StartupStage::Mqtt)
+      _currentStartupTimings.mqttMillis = millis() - _startupStageBeginMillis;
+
     onMQTTConnectionEstablished();
   }
 
@@ -292,51 +678,143 @@ bool EspMQTTClient::handleMQTT()
   else if (!isMqttConnected && _mqttConnected)
   {
     onMQTTConnectionLost();
-    _nextMqttConnectionAttemptMillis = millis() + _mqttReconnectionAttemptDelay;
+    _mqttDisconnectedSinceMillis = millis();
+
+    // When going back to the preferred broker, or when there is another broker to try, we don't wait.
+    // When the WiFi is lost, the broker is not at fault and stay selected.
+    if (_mqttFailingBack)
+    {
+      _nextMqttConnectionAttemptMillis = millis() + 1;
+      _mqttFailingBack = false;
+    }
+    else if (_mqttServerList.size() > 1 && isWifiConnected())
+    {
+      selectMqttServer((_mqttServerIndex + 1) % _mqttServerList.size());
+      _mqttFailoverCount = 1;
+      _nextMqttConnectionAttemptMillis = millis() + _mqttFailoverDelay;
+    }
+    else
+      _nextMqttConnectionAttemptMillis = millis() + _mqttReconnectionAttemptDelay;
+  }
+
+  // Connected to a fallback broker for long enough, we go back to the preferred one if it is reachable
+  else if (isMqttConnected && _mqttServerIndex != _mqttPreferredServerIndex && _mqttFailbackDelay > 0 && millis() - _mqttConnectedSinceMillis >= _mqttFailbackDelay)
+  {
+    if (probeMqttServer(_mqttPreferredServerIndex))
+    {
+      if (_enableDebugMessages)
+        Serial.printf("MQTT: Going back to broker \"%s\" (%fs)\n", _mqttServerList[_mqttPreferredServerIndex].ip, millis()/1000.0);
+
+      _mqttClient.disconnect();
+      selectMqttServer(_mqttPreferredServerIndex);
+      _mqttFailingBack = true;
+    }
+    else
+      _mqttConnectedSinceMillis = millis(); // Retry later
   }
 
   // It's time to connect to the MQTT broker
   else if (isWifiConnected() && _nextMqttConnectionAttemptMillis > 0 && millis() >= _nextMqttConnectionAttemptMillis)
   {
+    bool firstAttemptAfterWifi = _firstMqttAttemptAfterWifi;
+    _firstMqttAttemptAfterWifi = false;
+
+    // At the beginning of a connection round, we can select the fastest broker
+    if (_mqttServerLatencySelection && _mqttFailoverCount == 0 && _mqttServerList.size() > 1)
+      selectFastestMqttServer();
+
     // Connect to MQTT broker
     if(connectToMqttBroker())
     {
       _failedMQTTConnectionAttemptCount = 0;
       _nextMqttConnectionAttemptMillis = 0;
+      _mqttFailoverCount = 0;
+
+      // The settle delay is lowered step by step while the first attempts succeed
+      if(firstAttemptAfterWifi && _mqttConnectionDelayAfterWifi > 0)
+      {
+        _mqttConnectionDelayAfterWifi /= 2;
+        if(_wifiFastReconnect)
+          saveWifiConnectionHint();
+      }
+    }
+    // The reused IP lease may have expired or be taken by another device, the association still works
+    // but the broker is not reachable. We forget the lease and reconnect with DHCP.
+    else if(firstAttemptAfterWifi && _wifiReusedIpLease && _handleWiFi)
+    {
+      if (_enableDebugMessages)
+        Serial.printf("WiFi! Broker not reachable with the reused IP lease, reconnecting with DHCP (%fs).\n", millis()/1000.0);
+
+      _rtcState.localIp = 0;
+      saveRtcState();
+      _wifiReusedIpLease = false;
+
+      _mqttClient.disconnect();
+      WiFi.disconnect();
+    }
+    // The broker was not reachable right after the wifi connection, it may have been too early.
+    // We go back to the safe settle delay and retry the same broker, without counting a failed attempt.
+    else if(firstAttemptAfterWifi && _mqttConnectionDelayAfterWifi < 500)
+    {
+      _mqttConnectionDelayAfterWifi = 500;
+      if(_wifiFastReconnect)
+        saveWifiConnectionHint();
+
+      _mqttClient.disconnect();
+      _nextMqttConnectionAttemptMillis = millis() + _mqttConnectionDelayAfterWifi;
     }
     else
     {
-      // Connection failed, plan another connection attempt
-      _nextMqttConnectionAttemptMillis = millis() + _mqttReconnectionAttemptDelay;
       _mqttClient.disconnect();
-      _failedMQTTConnectionAttemptCount++;
 
-      if (_enableDebugMessages)
-        Serial.printf("MQTT!: Failed MQTT connection count: %i \n", _failedMQTTConnectionAttemptCount);
+      // Fail over to the next broker right away, until all of them have been tried
+      bool roundCompleted = true;
+      if (_mqttServerList.size() > 1)
+      {
+        selectMqttServer((_mqttServerIndex + 1) % _mqttServerList.size());
+        _mqttFailoverCount++;
+        roundCompleted = (_mqttFailoverCount >= _mqttServerList.size());
+      }
 
-      // When there is too many failed attempt, sometimes it help to reset the WiFi connection or to restart the board.
-      if(_handleWiFi && _failedMQTTConnectionAttemptCount == 8)
+      if (!roundCompleted)
+        _nextMqttConnectionAttemptMillis = millis() + _mqttFailoverDelay;
+      else
       {
-        if (_enableDebugMessages)
-          Serial.println("MQTT!: Can't connect to broker after too many attempt, resetting WiFi ...");
+        _mqttFailoverCount = 0;
 
-        WiFi.disconnect(true);
-        MDNS.end();
-        _nextWifiConnectionAttemptMillis = millis() + 500;
+        // Connection failed with all the brokers, plan another connection attempt
+        _nextMqttConnectionAttemptMillis = millis() + _mqttReconnectionAttemptDelay;
+        _failedMQTTConnectionAttemptCount++;
 
-        if(!_drasticResetOnConnectionFailures)
-          _failedMQTTConnectionAttemptCount = 0;
-      }
-      else if(_drasticResetOnConnectionFailures && _failedMQTTConnectionAttemptCount == 12) // Will reset after 12 failed attempt (3 minutes of retry)
-      {
         if (_enableDebugMessages)
-          Serial.println("MQTT!: Can't connect to broker after too many attempt, resetting board ...");
-
-        #ifdef ESP8266
-          ESP.reset();
-        #else
-          ESP.restart();
-        #endif
+          Serial.printf("MQTT!: Failed MQTT connection count: %i \n", _failedMQTTConnectionAttemptCount);
+
+        // When there is too many failed attempt, sometimes it help to reset the WiFi connection or to restart the board.
+        if(_handleWiFi && _failedMQTTConnectionAttemptCount == 8)
+        {
+          if (_enableDebugMessages)
+            Serial.println("MQTT!: Can't connect to broker after too many attempt, resetting WiFi ...");
+
+          WiFi.disconnect(true);
+          #ifndef ESP_MQTT_CLIENT_DISABLE_WEB_UPDATER
+            MDNS.end();
+          #endif
+          _nextWifiConnectionAttemptMillis = millis() + 500;
+
+          if(!_drasticResetOnConnectionFailures)
+            _failedMQTTConnectionAttemptCount = 0;
+        }
+        else if(_drasticResetOnConnectionFailures && _failedMQTTConnectionAttemptCount == 12) // Will reset after 12 failed attempt (3 minutes of retry)
+        {
+          if (_enableDebugMessages)
+            Serial.println("MQTT!: Can't connect to broker after too many attempt, resetting board ...");
+
+          #ifdef ESP8266
+            ESP.reset();
+          #else
+            ESP.restart();
+          #endif
+        }
       }
     }
   }
@@ -359,20 +837,17 @@ void EspMQTTClient::onWiFiConnectionEstablished()
     if (_enableDebugMessages)
       Serial.printf("WiFi: Connected (%fs), ip : %s \n", millis()/1000.0, WiFi.localIP().toString().c_str());
 
-    // Config of web updater
-    if (_httpServer != NULL)
-    {
-      MDNS.begin(_mqttClientName);
-      _httpUpdater->setup(_httpServer, _updateServerAddress, _updateServerUsername, _updateServerPassword);
-      _httpServer->begin();
-      MDNS.addService("http", "tcp", 80);
+    if (_wifiFastReconnect)
+      saveWifiConnectionHint();
 
-      if (_enableDebugMessages)
-        Serial.printf("WEB: Updater ready, open http://%s.local in your browser and login with username '%s' and password '%s'.\n", _mqttClientName, _updateServerUsername, _updateServerPassword);
-    }
+    // The web updater and OTA are started later, once the broker is connected, see handleStartup()
+    // The time spent without broker is counted from now, not from the boot or the WiFi loss
+    _mqttDisconnectedSinceMillis = millis();
 
-    if (_enableOTA)
-      ArduinoOTA.begin();
+    memset(&_currentStartupTimings, 0, sizeof(_currentStartupTimings));
+    _currentStartupTimings.wifiMillis = millis() - _startupBeginMillis;
+    _startupStage = StartupStage::Mqtt;
+    _startupStageBeginMillis = millis();
 }
 
 void EspMQTTClient::onWiFiConnectionLost()
@@ -380,17 +855,96 @@ void EspMQTTClient::onWiFiConnectionLost()
   if (_enableDebugMessages)
     Serial.printf("WiFi! Lost connection (%fs). \n", millis()/1000.0);
 
+  _startupStage = StartupStage::WiFi;
+  _startupBeginMillis = millis();
+
   // If we handle wifi, we force disconnection to clear the last connection
   if (_handleWiFi)
   {
     WiFi.disconnect(true);
-    MDNS.end();
+    #ifndef ESP_MQTT_CLIENT_DISABLE_WEB_UPDATER
+      MDNS.end();
+    #endif
+  }
+}
+
+// Start the secondary services once the broker is connected, one per loop() call, so they don't delay the first publish
+void EspMQTTClient::handleStartup()
+{
+  if (_startupStage == StartupStage::Mqtt)
+  {
+    // They are started anyway when the broker is not reachable, the updaters may be needed to fix it
+    if (!_mqttConnected && millis() - _startupStageBeginMillis < _servicesStartTimeout)
+      return;
+
+    _startupStage = StartupStage::WebUpdater;
+  }
+
+  if (_startupStage == StartupStage::WebUpdater)
+  {
+    _startupStage = StartupStage::OTA;
+
+    #ifndef ESP_MQTT_CLIENT_DISABLE_WEB_UPDATER
+      if (_httpServer != NULL)
+      {
+        ESP_MQTT_TRACE_SCOPE("startWebUpdater");
+        unsigned long startMillis = millis();
+
+        MDNS.begin(_mqttClientName);
+        if (!_httpUpdaterSetUp)
+        {
+          _httpUpdater->setup(_httpServer, _updateServerAddress, _updateServerUsername, _updateServerPassword);
+          _httpUpdaterSetUp = true;
+        }
+        _httpServer->begin();
+        MDNS.addService("http", "tcp", 80);
+
+        _currentStartupTimings.webUpdaterMillis = millis() - startMillis;
+
+        if (_enableDebugMessages)
+          Serial.printf("WEB: Updater ready, open http://%s.local in your browser and login with username '%s' and password '%s'.\n", _mqttClientName, _updateServerUsername, _updateServerPassword);
+
+        return; // OTA in the next loop() call
+      }
+    #endif
+  }
+
+  if (_startupStage == StartupStage::OTA)
+  {
+    #ifndef ESP_MQTT_CLIENT_DISABLE_OTA
+      if (_enableOTA)
+      {
+        ESP_MQTT_TRACE_SCOPE("ArduinoOTA.begin");
+        unsigned long startMillis = millis();
+        ArduinoOTA.begin();
+        _currentStartupTimings.otaMillis = millis() - startMillis;
+      }
+    #endif
+
+    _startupStage = StartupStage::Done;
+    _currentStartupTimings.totalMillis = millis() - _startupBeginMillis;
+
+    if (_bootTimings.totalMillis == 0)
+      _bootTimings = _currentStartupTimings;
+    else
+      _reconnectionTimings = _currentStartupTimings;
+
+    if (_enableDebugMessages)
+      Serial.printf("SYS: Startup completed in %lu ms (WiFi: %lu ms, MQTT: %lu ms, web updater: %lu ms, OTA: %lu ms)\n",
+        _currentStartupTimings.totalMillis, _currentStartupTimings.wifiMillis, _currentStartupTimings.mqttMillis,
+        _currentStartupTimings.webUpdaterMillis, _currentStartupTimings.otaMillis);
   }
 }
 
 void EspMQTTClient::onMQTTConnectionEstablished()
 {
+  // A single subscription receive the replies of all the calls
+  if (_rpcReplyTopic.length() > 0)
+    subscribe(_rpcReplyTopic + "/+", [this](const String &topic, const String &payload) { onRpcReplyReceived(topic, payload); });
+
   _connectionEstablishedCount++;
+
+  ESP_MQTT_TRACE_SCOPE("onConnectionEstablished");
   _connectionEstablishedCallback();
 }
 
@@ -429,68 +983,303 @@ bool EspMQTTClient::publish(const char* topic, const uint8_t* payload, unsigned
     return false;
   }
 
-  bool success = _mqttClient.publish(topic, payload, plength, retain);
-
-  if (_enableDebugMessages)
+  // Report by exception, an unchanged value is not published again before the heartbeat
+  ReportByExceptionRecord* reportRecord = NULL;
+  if (_reportByExceptionCapacity > 0)
   {
-    if(success)
-      Serial.printf("MQTT << [%s] %s\n", topic, payload);
-    else
-      Serial.println("MQTT! publish failed, is the message too long ? (see setMaxPacketSize())"); // This can occurs if the message is too long according to the maximum defined in PubsubClient.h
+    reportRecord = findReportByExceptionRecord(topic, true);
+    if (reportRecord != NULL && !isReportNeeded(*reportRecord, payload, plength))
+    {
+      _suppressedPublishCount++;
+      return true;
+    }
   }
 
-  return success;
-}
+  bool success = rateLimitAndPublish(topic, payload, plength, retain);
 
+  if (success && reportRecord != NULL)
+    updateReportByExceptionRecord(*reportRecord, payload, plength);
 
-bool EspMQTTClient::publish(const String &topic, const String &payload, bool retain)
-{
-  return publish(topic.c_str(), (const uint8_t*) payload.c_str(), payload.length(), retain);
+  return success;
 }
 
-bool EspMQTTClient::subscribe(const String &topic, MessageReceivedCallback messageReceivedCallback, uint8_t qos)
+bool EspMQTTClient::rateLimitAndPublish(const char* topic, const uint8_t* payload, unsigned int plength, bool retain)
 {
-  // Do not try to subscribe if MQTT is not connected.
-  if(!isConnected())
+  // Rate limiting
+  PublishRateLimitRecord* topicLimit = findPublishRateLimit(topic);
+  bool globalLimitEnabled = (_globalPublishRateLimit.messagesPerSecond > 0 || _globalPublishRateLimit.bytesPerSecond > 0);
+
+  if (globalLimitEnabled || topicLimit != NULL)
   {
-    if (_enableDebugMessages)
-      Serial.println("MQTT! Trying to subscribe when disconnected, skipping.");
+    refillPublishRateLimit(_globalPublishRateLimit);
+    if (topicLimit != NULL)
+      refillPublishRateLimit(*topicLimit);
 
-    return false;
+    // A message already waiting for the same topic must be sent first
+    bool alreadyQueued = false;
+    for (std::size_t i = 0; i < _publishQueue.size() && !alreadyQueued; i++)
+      alreadyQueued = _publishQueue[i].topic.equals(topic);
+
+    bool allowed = !alreadyQueued && hasPublishTokens(_globalPublishRateLimit, plength) && (topicLimit == NULL || hasPublishTokens(*topicLimit, plength));
+
+    if (allowed)
+    {
+      consumePublishTokens(_globalPublishRateLimit, plength);
+      if (topicLimit != NULL)
+        consumePublishTokens(*topicLimit, plength);
+    }
+    else
+    {
+      PublishRateLimitMode mode = (topicLimit != NULL ? topicLimit->mode : _globalPublishRateLimit.mode);
+
+      if (mode == PublishRateLimitMode::Coalesce)
+      {
+        for (std::size_t i = 0; i < _publishQueue.size(); i++)
+        {
+          if (_publishQueue[i].topic.equals(topic))
+          {
+            _publishQueue[i].payload.assign(payload, payload + plength);
+            _publishQueue[i].retain = retain;
+            _publishRateLimitCounters.coalesced++;
+            return true;
+          }
+        }
+      }
+
+      if (mode == PublishRateLimitMode::Reject || _publishQueue.size() >= _publishQueueMaxSize)
+      {
+        _publishRateLimitCounters.rejected++;
+
+        if (_enableDebugMessages)
+          Serial.printf("MQTT! Publish rate limit reached, message to [%s] rejected.\n", topic);
+
+        return false;
+      }
+
+      _publishQueue.push_back({ topic, std::vector<uint8_t>(payload, payload + plength), retain });
+      _publishRateLimitCounters.queued++;
+      return true;
+    }
   }
 
-  bool success = _mqttClient.subscribe(topic.c_str(), qos);
+  bool success = publishToBroker(topic, payload, plength, retain);
+  if (success)
+    _publishRateLimitCounters.sent++;
 
-  if(success)
+  return success;
+}
+
+bool EspMQTTClient::publishToBroker(const char* topic, const uint8_t* payload, unsigned int plength, bool retain)
+{
+  bool success = _mqttClient.publish(topic, payload, plength, retain);
+
+  if (success && _firstPublishMillis == 0)
   {
-    // Add the record to the subscription list only if it does not exists.
-    bool found = false;
-    for (std::size_t i = 0; i < _topicSubscriptionList.size() && !found; i++)
-      found = _topicSubscriptionList[i].topic.equals(topic);
+    _firstPublishMillis = millis();
 
-    if(!found)
-      _topicSubscriptionList.push_back({ topic, messageReceivedCallback, NULL });
+    if (_enableDebugMessages)
+      Serial.printf("MQTT: First publish %fs after boot\n", _firstPublishMillis/1000.0);
   }
 
   if (_enableDebugMessages)
   {
     if(success)
-      Serial.printf("MQTT: Subscribed to [%s]\n", topic.c_str());
+      Serial.printf("MQTT << [%s] %.*s\n", topic, (int)plength, (const char*)payload); // A queued payload is not null terminated
     else
-      Serial.println("MQTT! subscribe failed");
+      Serial.println("MQTT! publish failed, is the message too long ? (see setMaxPacketSize())"); // This can occurs if the message is too long according to the maximum defined in PubsubClient.h
   }
 
   return success;
 }
 
-bool EspMQTTClient::subscribe(const String &topic, MessageReceivedCallbackWithTopic messageReceivedCallback, uint8_t qos)
+
+bool EspMQTTClient::publish(const String &topic, const String &payload, bool retain)
 {
-  if(subscribe(topic, (MessageReceivedCallback)NULL, qos))
+  return publish(topic.c_str(), (const uint8_t*) payload.c_str(), payload.length(), retain);
+}
+
+void EspMQTTClient::setPublishDeadband(const String &topic, const float absolute, const float percent)
+{
+  ReportByExceptionRecord* record = findReportByExceptionRecord(topic.c_str(), true);
+
+  if (record != NULL)
   {
-    _topicSubscriptionList[_topicSubscriptionList.size()-1].callbackWithTopic = messageReceivedCallback;
-    return true;
+    record->deadbandAbsolute = absolute;
+    record->deadbandPercent = percent;
+  }
+  else if (_enableDebugMessages)
+    Serial.println("MQTT! Report by exception is not enabled, the topic is too long or the table is full of deadbands, deadband ignored.");
+}
+
+void EspMQTTClient::setPublishRateLimit(const float messagesPerSecond, const unsigned long bytesPerSecond, const PublishRateLimitMode mode)
+{
+  _globalPublishRateLimit = { "", messagesPerSecond, (float)bytesPerSecond, messagesPerSecond, (float)bytesPerSecond, millis(), mode };
+}
+
+void EspMQTTClient::setPublishRateLimit(const String &topicPrefix, const float messagesPerSecond, const unsigned long bytesPerSecond, const PublishRateLimitMode mode)
+{
+  PublishRateLimitRecord limit = { topicPrefix, messagesPerSecond, (float)bytesPerSecond, messagesPerSecond, (float)bytesPerSecond, millis(), mode };
+
+  for (std::size_t i = 0; i < _topicPublishRateLimitList.size(); i++)
+  {
+    if (_topicPublishRateLimitList[i].topicPrefix.equals(topicPrefix))
+    {
+      _topicPublishRateLimitList[i] = limit;
+      return;
+    }
+  }
+
+  _topicPublishRateLimitList.push_back(limit);
+}
+
+bool EspMQTTClient::call(const String &requestTopic, const String &payload, RpcResponseCallback callback, const unsigned long timeout)
+{
+  if (_rpcReplyTopic.length() == 0)
+  {
+    if (_enableDebugMessages)
+      Serial.println("MQTT! call() used without enableRPC(), skipping.");
+
+    return false;
+  }
+
+  // Find a free slot in the pending call table
+  std::size_t slot = 0;
+  while (slot < _pendingRpcList.size() && _pendingRpcList[slot].pending)
+    slot++;
+
+  if (slot == _pendingRpcList.size())
+  {
+    if (_enableDebugMessages)
+      Serial.println("MQTT! Too many pending calls, skipping.");
+
+    return false;
+  }
+
+  if (!isConnected())
+  {
+    if (_enableDebugMessages)
+      Serial.println("MQTT! Trying to call when disconnected, skipping.");
+
+    return false;
+  }
+
+  // Each request has its own topic, it is never a repeated value: report by exception is bypassed
+  uint16_t correlationId = ++_nextRpcCorrelationId;
+  String requestTopicWithId = requestTopic + "/" + String(correlationId);
+  if (!rateLimitAndPublish(requestTopicWithId.c_str(), (const uint8_t*)payload.c_str(), payload.length(), false))
+    return false;
+
+  // The timeout is checked by loop(), the slot is freed as soon as the reply is received
+  _pendingRpcList[slot] = { correlationId, true, millis(), timeout, callback };
+
+  return true;
+}
+
+unsigned int EspMQTTClient::getPendingCallCount() const
+{
+  unsigned int count = 0;
+  for (std::size_t i = 0; i < _pendingRpcList.size(); i++)
+  {
+    if (_pendingRpcList[i].pending)
+      count++;
+  }
+  return count;
+}
+
+void EspMQTTClient::addLastValueCacheFilter(const String &topicFilter)
+{
+  for (std::size_t i = 0; i < _lastValueCacheFilterList.size(); i++)
+  {
+    if (_lastValueCacheFilterList[i].topic.equals(topicFilter))
+      return;
   }
-  return false;
+
+  TopicFilterRecord record = { topicFilter, EspMQTTTopicFilter() };
+  if (record.filter.compile(topicFilter.c_str(), topicFilter.length()))
+    _lastValueCacheFilterList.push_back(record);
+  else if (_enableDebugMessages)
+    Serial.printf("MQTT! Invalid topic filter [%s], skipping.\n", topicFilter.c_str());
+}
+
+const char* EspMQTTClient::getLastValue(const char* topic, unsigned int* length, uint32_t* generation)
+{
+  LastValueCacheEntry* entry = findLastValueCacheEntry(topic, fnv1aHash((const uint8_t*)topic, strlen(topic)));
+  if (entry == NULL)
+    return NULL;
+
+  entry->lastUsed = ++_lastValueCacheClock;
+
+  if (length != NULL)
+    *length = entry->payloadLength;
+  if (generation != NULL)
+    *generation = entry->generation;
+
+  return getLastValueCachePayload(entry);
+}
+
+uint32_t EspMQTTClient::getLastValueGeneration(const char* topic)
+{
+  LastValueCacheEntry* entry = findLastValueCacheEntry(topic, fnv1aHash((const uint8_t*)topic, strlen(topic)));
+  return entry != NULL ? entry->generation : 0;
+}
+
+bool EspMQTTClient::subscribe(const String &topic, MessageReceivedCallback messageReceivedCallback, uint8_t qos)
+{
+  // Do not try to subscribe if MQTT is not connected.
+  if(!isConnected())
+  {
+    if (_enableDebugMessages)
+      Serial.println("MQTT! Trying to subscribe when disconnected, skipping.");
+
+    return false;
+  }
+
+  // The filter is validated and compiled once here, it is then used for each received message
+  EspMQTTTopicFilter filter;
+  if(!filter.compile(topic.c_str(), topic.length()))
+  {
+    if (_enableDebugMessages)
+      Serial.printf("MQTT! Invalid topic filter [%s], skipping.\n", topic.c_str());
+
+    return false;
+  }
+
+  bool success = _mqttClient.subscribe(topic.c_str(), qos);
+
+  if(success)
+  {
+    // Add the record to the subscription list only if it does not exists.
+    bool found = false;
+    for (std::size_t i = 0; i < _topicSubscriptionList.size() && !found; i++)
+      found = _topicSubscriptionList[i].topic.equals(topic);
+
+    if(!found)
+      _topicSubscriptionList.push_back({ topic, messageReceivedCallback, NULL, NULL, filter });
+  }
+
+  if (_enableDebugMessages)
+  {
+    if(success)
+      Serial.printf("MQTT: Subscribed to [%s]\n", topic.c_str());
+    else
+      Serial.println("MQTT! subscribe failed");
+  }
+
+  return success;
+}
+
+bool EspMQTTClient::subscribe(const String &topic, MessageReceivedCallbackWithTopic messageReceivedCallback, uint8_t qos)
+{
+  if(!subscribe(topic, (MessageReceivedCallback)NULL, qos))
+    return false;
+
+  // The record may already exist (e.g. subscribing again after a reconnection), it is not always the last one
+  for (std::size_t i = 0; i < _topicSubscriptionList.size(); i++)
+  {
+    if (_topicSubscriptionList[i].topic.equals(topic))
+      _topicSubscriptionList[i].callbackWithTopic = messageReceivedCallback;
+  }
+  return true;
 }
 
 bool EspMQTTClient::unsubscribe(const String &topic)
@@ -529,11 +1318,188 @@ bool EspMQTTClient::unsubscribe(const String &topic)
   return true;
 }
 
+bool EspMQTTClient::subscribeRaw(const String &topic, RawMessageReceivedCallback messageReceivedCallback, uint8_t qos)
+{
+  if(!subscribe(topic, (MessageReceivedCallback)NULL, qos))
+    return false;
+
+  for (std::size_t i = 0; i < _topicSubscriptionList.size(); i++)
+  {
+    if (_topicSubscriptionList[i].topic.equals(topic))
+      _topicSubscriptionList[i].rawCallback = messageReceivedCallback;
+  }
+  return true;
+}
+
+bool EspMQTTClient::subscribeInt(const String &topic, IntMessageReceivedCallback messageReceivedCallback, uint8_t qos)
+{
+  return subscribeRaw(topic, [this, messageReceivedCallback](const char* payload, unsigned int length) {
+    long value;
+    if (EspMQTTPayload::parseInt(payload, length, value))
+      messageReceivedCallback(value);
+    else if (_enableDebugMessages)
+      Serial.println("MQTT! Payload is not an integer, skipping.");
+  }, qos);
+}
+
+bool EspMQTTClient::subscribeFloat(const String &topic, FloatMessageReceivedCallback messageReceivedCallback, uint8_t qos)
+{
+  return subscribeRaw(topic, [this, messageReceivedCallback](const char* payload, unsigned int length) {
+    float value;
+    if (EspMQTTPayload::parseFloat(payload, length, value))
+      messageReceivedCallback(value);
+    else if (_enableDebugMessages)
+      Serial.println("MQTT! Payload is not a number, skipping.");
+  }, qos);
+}
+
+bool EspMQTTClient::subscribeBool(const String &topic, BoolMessageReceivedCallback messageReceivedCallback, uint8_t qos)
+{
+  return subscribeRaw(topic, [this, messageReceivedCallback](const char* payload, unsigned int length) {
+    bool value;
+    if (EspMQTTPayload::parseBool(payload, length, value))
+      messageReceivedCallback(value);
+    else if (_enableDebugMessages)
+      Serial.println("MQTT! Payload is not a boolean, skipping.");
+  }, qos);
+}
+
+bool EspMQTTClient::subscribeEnum(const String &topic, const char* const* values, const uint8_t valueCount, IntMessageReceivedCallback messageReceivedCallback, uint8_t qos)
+{
+  return subscribeRaw(topic, [this, values, valueCount, messageReceivedCallback](const char* payload, unsigned int length) {
+    EspMQTTPayload::trim(payload, length);
+
+    for (uint8_t i = 0; i < valueCount; i++)
+    {
+      if (strlen(values[i]) == length && strncmp(values[i], payload, length) == 0)
+      {
+        messageReceivedCallback(i);
+        return;
+      }
+    }
+
+    if (_enableDebugMessages)
+      Serial.println("MQTT! Payload is not a known enum value, skipping.");
+  }, qos);
+}
+
+bool EspMQTTClient::subscribeJsonInt(const String &topic, const char* key, IntMessageReceivedCallback messageReceivedCallback, uint8_t qos)
+{
+  String keyStr(key);
+  return subscribeRaw(topic, [this, keyStr, messageReceivedCallback](const char* payload, unsigned int length) {
+    long value;
+    if (EspMQTTPayload::findJsonValue(payload, length, keyStr.c_str(), payload, length) && EspMQTTPayload::parseInt(payload, length, value))
+      messageReceivedCallback(value);
+    else if (_enableDebugMessages)
+      Serial.printf("MQTT! Key \"%s\" not found or not an integer, skipping.\n", keyStr.c_str());
+  }, qos);
+}
+
+bool EspMQTTClient::subscribeJsonFloat(const String &topic, const char* key, FloatMessageReceivedCallback messageReceivedCallback, uint8_t qos)
+{
+  String keyStr(key);
+  return subscribeRaw(topic, [this, keyStr, messageReceivedCallback](const char* payload, unsigned int length) {
+    float value;
+    if (EspMQTTPayload::findJsonValue(payload, length, keyStr.c_str(), payload, length) && EspMQTTPayload::parseFloat(payload, length, value))
+      messageReceivedCallback(value);
+    else if (_enableDebugMessages)
+      Serial.printf("MQTT! Key \"%s\" not found or not a number, skipping.\n", keyStr.c_str());
+  }, qos);
+}
+
+bool EspMQTTClient::subscribeJsonBool(const String &topic, const char* key, BoolMessageReceivedCallback messageReceivedCallback, uint8_t qos)
+{
+  String keyStr(key);
+  return subscribeRaw(topic, [this, keyStr, messageReceivedCallback](const char* payload, unsigned int length) {
+    bool value;
+    if (EspMQTTPayload::findJsonValue(payload, length, keyStr.c_str(), payload, length) && EspMQTTPayload::parseBool(payload, length, value))
+      messageReceivedCallback(value);
+    else if (_enableDebugMessages)
+      Serial.printf("MQTT! Key \"%s\" not found or not a boolean, skipping.\n", keyStr.c_str());
+  }, qos);
+}
+
 void EspMQTTClient::setKeepAlive(uint16_t keepAliveSeconds)
 {
   _mqttClient.setKeepAlive(keepAliveSeconds);
 }
 
+void EspMQTTClient::setTransportClient(Client &client)
+{
+  #ifdef ESP_MQTT_CLIENT_ENABLE_CAPTURE
+    // Keep capturing, with the new transport
+    if (_transportClient == &_captureClient)
+    {
+      _captureClient.setClient(client);
+      return;
+    }
+  #endif
+
+  _transportClient = &client;
+  _mqttClient.setClient(client);
+}
+
+#ifdef ESP_MQTT_CLIENT_ENABLE_CAPTURE
+void EspMQTTClient::enableCapture(Print* output)
+{
+  if (_transportClient == &_captureClient)
+    return;
+
+  _captureClient.begin(*_transportClient, output);
+  _transportClient = &_captureClient;
+  _mqttClient.setClient(_captureClient);
+}
+#endif
+
+#ifndef ESP8266
+bool EspMQTTClient::connectAndVerifyTlsServer()
+{
+  if (!_transportClient->connect(_mqttServerIp, _mqttServerPort))
+    return false;
+
+  if (!_secureClient->verify(_tlsFingerprint, NULL))
+  {
+    if (_enableDebugMessages)
+      Serial.print(" - TLS fingerprint mismatch");
+
+    _transportClient->stop();
+    return false;
+  }
+
+  return true;
+}
+#endif
+
+void EspMQTTClient::setTLSBufferSizes(const int receiveSize, const int transmitSize)
+{
+  #ifdef ESP8266
+    if (_secureClient != NULL)
+      _secureClient->setBufferSizes(receiveSize, transmitSize);
+    else if (_enableDebugMessages)
+      Serial.print("SYS! setTLSBufferSizes() must be called after enableTLS().\n");
+  #else
+    if (_enableDebugMessages)
+      Serial.print("SYS! setTLSBufferSizes() is not supported on ESP32.\n");
+  #endif
+}
+
+void EspMQTTClient::setMqttServer(const char* server, const char* username, const char* password, const uint16_t port)
+{
+  _mqttServerList[0] = { server, username, password, port, _mqttServerList[0].stats };
+  if (_mqttServerIndex == 0)
+    selectMqttServer(0);
+}
+
+void EspMQTTClient::addMqttServer(const char* server, const char* username, const char* password, const uint16_t port)
+{
+  _mqttServerList.push_back({ server, username, password, port, {} });
+}
+
+void EspMQTTClient::enableMqttServerLatencySelection(const bool enabled)
+{
+  _mqttServerLatencySelection = enabled;
+}
+
 void EspMQTTClient::setWifiCredentials(const char* wifiSsid, const char* wifiPassword)
 {
   _wifiSsid = wifiSsid;
@@ -541,6 +1507,14 @@ void EspMQTTClient::setWifiCredentials(const char* wifiSsid, const char* wifiPas
   _handleWiFi = true;
 }
 
+void EspMQTTClient::setWifiStaticIp(const IPAddress &ip, const IPAddress &gateway, const IPAddress &subnet, const IPAddress &dns)
+{
+  _wifiStaticIp = ip;
+  _wifiStaticGateway = gateway;
+  _wifiStaticSubnet = subnet;
+  _wifiStaticDns = dns;
+}
+
 void EspMQTTClient::executeDelayed(const unsigned long delay, DelayedExecutionCallback callback)
 {
   DelayedExecutionRecord delayedExecutionRecord;
@@ -550,27 +1524,133 @@ void EspMQTTClient::executeDelayed(const unsigned long delay, DelayedExecutionCa
   _delayedExecutionList.push_back(delayedExecutionRecord);
 }
 
+void EspMQTTClient::sleep(const unsigned long seconds)
+{
+  if (_enableDebugMessages)
+    Serial.printf("SYS: Going in deep sleep for %lus, awake for %lums\n", seconds, millis());
+
+  // The DISCONNECT packet is sent after the publishes on the same TCP connection,
+  // so the broker has processed them once it is received.
+  if (_mqttClient.connected())
+    _mqttClient.disconnect();
+  _transportClient->flush();
+
+  if (_handleWiFi)
+    WiFi.disconnect(true);
+
+  // millis() restart from 0 at each wake up
+  _rtcState.lastAwakeMillis = millis();
+  saveRtcState();
+
+  #ifdef ESP8266
+    ESP.deepSleep((uint64_t)seconds * 1000000);
+  #else
+    esp_deep_sleep((uint64_t)seconds * 1000000);
+  #endif
+}
+
 
 // ================== Private functions ====================-
 
 // Initiate a Wifi connection (non-blocking)
 void EspMQTTClient::connectToWifi()
 {
+  ESP_MQTT_TRACE_SCOPE("connectToWifi");
+
   WiFi.mode(WIFI_STA);
   #ifdef ESP32
     WiFi.setHostname(_mqttClientName);
   #else
     WiFi.hostname(_mqttClientName);
   #endif
-  WiFi.begin(_wifiSsid, _wifiPassword);
+
+  bool useHint = _wifiFastReconnect && _rtcState.channel != 0;
+  _wifiReusedIpLease = false;
+
+  // A static IP skip DHCP, either set by the user or reused from the last lease
+  if ((uint32_t)_wifiStaticIp != 0)
+    WiFi.config(_wifiStaticIp, _wifiStaticGateway, _wifiStaticSubnet, _wifiStaticDns);
+  else if (useHint && _wifiFastReconnectReuseIp && _rtcState.localIp != 0)
+  {
+    WiFi.config(IPAddress(_rtcState.localIp), IPAddress(_rtcState.gatewayIp), IPAddress(_rtcState.subnetMask), IPAddress(_rtcState.dnsIp));
+    _wifiReusedIpLease = true;
+  }
+  else if (_wifiFastReconnectReuseIp)
+    WiFi.config(IPAddress(), IPAddress(), IPAddress()); // Back to DHCP after a failed fast attempt
+
+  // Direct association with the last known access point, without scanning
+  if (useHint)
+    WiFi.begin(_wifiSsid, _wifiPassword, _rtcState.channel, _rtcState.bssid);
+  else
+    WiFi.begin(_wifiSsid, _wifiPassword);
+
+  _connectingToWifiWithHint = useHint;
 
   if (_enableDebugMessages)
-    Serial.printf("\nWiFi: Connecting to %s ... (%fs) \n", _wifiSsid, millis()/1000.0);
+    Serial.printf("\nWiFi: Connecting to %s%s ... (%fs) \n", _wifiSsid, useHint ? " (fast)" : "", millis()/1000.0);
+}
+
+// Remember the current access point and IP lease for the next connection
+void EspMQTTClient::saveWifiConnectionHint()
+{
+  memcpy(_rtcState.bssid, WiFi.BSSID(), sizeof(_rtcState.bssid));
+  _rtcState.channel = WiFi.channel();
+  _rtcState.localIp = WiFi.localIP();
+  _rtcState.gatewayIp = WiFi.gatewayIP();
+  _rtcState.subnetMask = WiFi.subnetMask();
+  _rtcState.dnsIp = WiFi.dnsIP();
+  _rtcState.mqttConnectionDelayAfterWifi = _mqttConnectionDelayAfterWifi;
+  saveRtcState();
+}
+
+void EspMQTTClient::clearWifiConnectionHint()
+{
+  _rtcState.channel = 0;
+  _rtcState.localIp = 0;
+  saveRtcState();
+}
+
+// Load the state saved in RTC memory, return false if there is nothing valid
+bool EspMQTTClient::loadRtcState()
+{
+  // Already loaded, reading it again would discard the changes made since (e.g. the duty cycle count)
+  if (_rtcStateLoaded)
+    return true;
+
+  RtcState state;
+
+  #ifdef ESP8266
+    if (!ESP.rtcUserMemoryRead(ESP_MQTT_CLIENT_RTC_OFFSET, (uint32_t*)&state, sizeof(state)))
+      return false;
+  #else
+    static_assert(sizeof(RtcState) <= sizeof(rtcStateStorage), "rtcStateStorage is too small");
+    memcpy(&state, rtcStateStorage, sizeof(state));
+  #endif
+
+  if (state.checksum != fnv1aHash((const uint8_t*)&state + sizeof(state.checksum), sizeof(state) - sizeof(state.checksum)))
+    return false;
+
+  _rtcState = state;
+  _rtcStateLoaded = true;
+  return true;
+}
+
+void EspMQTTClient::saveRtcState()
+{
+  _rtcState.checksum = fnv1aHash((const uint8_t*)&_rtcState + sizeof(_rtcState.checksum), sizeof(_rtcState) - sizeof(_rtcState.checksum));
+
+  #ifdef ESP8266
+    ESP.rtcUserMemoryWrite(ESP_MQTT_CLIENT_RTC_OFFSET, (uint32_t*)&_rtcState, sizeof(_rtcState));
+  #else
+    memcpy(rtcStateStorage, &_rtcState, sizeof(_rtcState));
+  #endif
 }
 
 // Try to connect to the MQTT broker and return True if the connection is successfull (blocking)
 bool EspMQTTClient::connectToMqttBroker()
 {
+  ESP_MQTT_TRACE_SCOPE("connectToMqttBroker");
+
   bool success = false;
 
   if (_mqttServerIp != nullptr && strlen(_mqttServerIp) > 0)
@@ -585,7 +1665,29 @@ bool EspMQTTClient::connectToMqttBroker()
 
     // explicitly set the server/port here in case they were not provided in the constructor
     _mqttClient.setServer(_mqttServerIp, _mqttServerPort);
-    success = _mqttClient.connect(_mqttClientName, _mqttUsername, _mqttPassword, _mqttLastWillTopic, 0, _mqttLastWillRetain, _mqttLastWillMessage, _mqttCleanSession);
+
+    unsigned long connectionStartMillis = millis();
+
+    // ESP32 can only check the server fingerprint once connected, this is done before PubSubClient
+    // send the credentials. PubSubClient then reuse the connected transport.
+    bool transportReady = true;
+    #ifndef ESP8266
+      if (_tlsConnectAndVerify != NULL)
+        transportReady = (this->*_tlsConnectAndVerify)();
+    #endif
+
+    if (transportReady)
+      success = _mqttClient.connect(_mqttClientName, _mqttUsername, _mqttPassword, _mqttLastWillTopic, 0, _mqttLastWillRetain, _mqttLastWillMessage, _mqttCleanSession);
+    _lastMqttConnectionDuration = millis() - connectionStartMillis;
+
+    // The time since the last attempt is charged to this broker
+    MqttServerStats &stats = _mqttServerList[_mqttServerIndex].stats;
+    stats.disconnectedMillis += millis() - _mqttDisconnectedSinceMillis;
+    _mqttDisconnectedSinceMillis = millis();
+    if (success)
+      stats.connectionCount++;
+    else
+      stats.failedConnectionCount++;
   }
   else
   {
@@ -597,7 +1699,7 @@ bool EspMQTTClient::connectToMqttBroker()
   if (_enableDebugMessages)
   {
     if (success)
-      Serial.printf(" - ok. (%fs) \n", millis()/1000.0);
+      Serial.printf(" - ok in %lums. (%fs) \n", _lastMqttConnectionDuration, millis()/1000.0);
     else
     {
       Serial.printf("unable to connect (%fs), reason: ", millis()/1000.0);
@@ -640,6 +1742,55 @@ bool EspMQTTClient::connectToMqttBroker()
   return success;
 }
 
+void EspMQTTClient::selectMqttServer(const uint8_t index)
+{
+  _mqttServerIndex = index;
+  _mqttServerIp = _mqttServerList[index].ip;
+  _mqttUsername = _mqttServerList[index].username;
+  _mqttPassword = _mqttServerList[index].password;
+  _mqttServerPort = _mqttServerList[index].port;
+}
+
+// Measure the TCP connection time of each broker and select the fastest reachable one (blocking)
+void EspMQTTClient::selectFastestMqttServer()
+{
+  int fastestIndex = -1;
+
+  for (uint8_t i = 0; i < _mqttServerList.size(); i++)
+  {
+    if (probeMqttServer(i) && (fastestIndex < 0 || _mqttServerList[i].stats.lastRoundTripMillis < _mqttServerList[fastestIndex].stats.lastRoundTripMillis))
+      fastestIndex = i;
+  }
+
+  if (fastestIndex >= 0)
+  {
+    selectMqttServer(fastestIndex);
+    _mqttPreferredServerIndex = fastestIndex;
+
+    if (_enableDebugMessages)
+      Serial.printf("MQTT: Broker \"%s\" selected, %lums to connect\n", _mqttServerIp, _mqttServerList[fastestIndex].stats.lastRoundTripMillis);
+  }
+}
+
+// Return true if a TCP connection to the broker can be made, and keep the time it took (blocking)
+bool EspMQTTClient::probeMqttServer(const uint8_t index)
+{
+  MqttServerRecord &server = _mqttServerList[index];
+  server.stats.lastRoundTripMillis = 0;
+
+  if (server.ip == nullptr || strlen(server.ip) == 0)
+    return false;
+
+  WiFiClient probeClient;
+  unsigned long startMillis = millis();
+  if (!probeClient.connect(server.ip, server.port))
+    return false;
+
+  server.stats.lastRoundTripMillis = std::max<unsigned long>(1, millis() - startMillis);
+  probeClient.stop();
+  return true;
+}
+
 // Delayed execution handling.
 // Check if there is delayed execution requests to process and execute them if needed.
 void EspMQTTClient::processDelayedExecutionRequests()
@@ -652,6 +1803,7 @@ void EspMQTTClient::processDelayedExecutionRequests()
     {
       if (_delayedExecutionList[i].targetMillis <= currentMillis)
       {
+        ESP_MQTT_TRACE_SCOPE("delayedExecution");
         _delayedExecutionList[i].callback();
         _delayedExecutionList.erase(_delayedExecutionList.begin() + i);
         i--;
@@ -660,69 +1812,325 @@ void EspMQTTClient::processDelayedExecutionRequests()
   }
 }
 
-/**
- * Matching MQTT topics, handling the eventual presence of wildcards character
- * It doesn't validate the correctness of the topic pattern.
- *
- * @param topic1 may contain wildcards (+, #)
- * @param topic2 must not contain wildcards
- * @return true on MQTT topic match, false otherwise
- */
-bool EspMQTTClient::mqttTopicMatch(const String &topic1, const String &topic2)
+// Match a reply with its pending call, using the correlation id at the end of the topic
+void EspMQTTClient::onRpcReplyReceived(const String &topic, const String &payload)
 {
-  const char *topic1_p = topic1.begin();
-  const char *topic1_end = topic1.end();
-  const char *topic2_p = topic2.begin();
-  const char *topic2_end = topic2.end();
+  long correlationId;
+  const char* id = topic.c_str() + _rpcReplyTopic.length() + 1;
+  if (!EspMQTTPayload::parseInt(id, strlen(id), correlationId))
+    return;
 
-  while (topic1_p < topic1_end && topic2_p < topic2_end)
+  for (std::size_t i = 0; i < _pendingRpcList.size(); i++)
   {
-    if (*topic1_p == '#')
+    PendingRpcRecord &record = _pendingRpcList[i];
+    if (record.pending && record.correlationId == correlationId)
     {
-      // we assume '#' can be present only at the end of the topic pattern
-      return true;
+      // The slot can be reused by the callback
+      RpcResponseCallback callback = record.callback;
+      record.pending = false;
+      callback(true, payload);
+      return;
     }
+  }
 
-    if (*topic1_p == '+')
+  if (_enableDebugMessages)
+    Serial.printf("MQTT! Reply to an unknown or expired call (%ld), skipping.\n", correlationId);
+}
+
+// Complete the calls without a reply in time
+void EspMQTTClient::processRpcTimeouts()
+{
+  for (std::size_t i = 0; i < _pendingRpcList.size(); i++)
+  {
+    PendingRpcRecord &record = _pendingRpcList[i];
+    if (record.pending && millis() - record.startMillis >= record.timeout)
     {
-      // move to the end of the matched section (till next '/' if any, otherwise the end of text)
-      const char *temp = strchr(topic2_p, '/');
-      if (temp)
-        topic2_p = temp;
-      else
-        topic2_p = topic2_end;
+      // The slot can be reused by the callback
+      RpcResponseCallback callback = record.callback;
+      record.pending = false;
+
+      if (_enableDebugMessages)
+        Serial.printf("MQTT! Call %u timed out.\n", record.correlationId);
 
-      ++topic1_p;
-      continue;
+      callback(false, "");
     }
+  }
+}
 
-    // find the end of current section, it is either before next wildcard or at the end of text
-    const char* temp = strchr(topic1_p, '+');
-    int len = temp == NULL ? topic1_end - topic1_p : temp - topic1_p;
-    if (topic1_p[len - 1] == '#')
-      --len;
+// ================== Last value cache ====================
 
-    if (topic2_end - topic2_p < len)
-      return false;
+// Each entry data is "topic\0payload\0"
+char* EspMQTTClient::getLastValueCacheTopic(const LastValueCacheEntry* entry)
+{
+  return _lastValueCacheData + (entry - _lastValueCacheEntries) * (_lastValueCacheMaxTopicLength + _lastValueCacheMaxPayloadLength + 2);
+}
 
-    if (strncmp(topic1_p, topic2_p, len))
-      return false;
+char* EspMQTTClient::getLastValueCachePayload(const LastValueCacheEntry* entry)
+{
+  return getLastValueCacheTopic(entry) + entry->topicLength + 1;
+}
+
+EspMQTTClient::LastValueCacheEntry* EspMQTTClient::findLastValueCacheEntry(const char* topic, uint32_t topicHash)
+{
+  for (uint8_t i = 0; i < _lastValueCacheCapacity; i++)
+  {
+    LastValueCacheEntry* entry = &_lastValueCacheEntries[i];
+    if (entry->generation != 0 && entry->topicHash == topicHash && strcmp(getLastValueCacheTopic(entry), topic) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+// Store the message if it match a cache filter. An empty payload remove the topic from the cache.
+void EspMQTTClient::updateLastValueCache(const char* topic, const char* payload, unsigned int length)
+{
+  bool match = false;
+  for (std::size_t i = 0; i < _lastValueCacheFilterList.size() && !match; i++)
+    match = _lastValueCacheFilterList[i].filter.matches(_lastValueCacheFilterList[i].topic.c_str(), _receivedTopic);
 
-    topic1_p += len;
-    topic2_p += len;
+  if (!match)
+    return;
+
+  unsigned int topicLength = strlen(topic);
+  uint32_t topicHash = fnv1aHash((const uint8_t*)topic, topicLength);
+  LastValueCacheEntry* entry = findLastValueCacheEntry(topic, topicHash);
+
+  if (length == 0)
+  {
+    if (entry != NULL)
+      entry->generation = 0;
+    return;
   }
 
-  // Check if there is any remaining characters not matched
-  return !(topic1_p < topic1_end || topic2_p < topic2_end);
+  if (topicLength > _lastValueCacheMaxTopicLength || length > _lastValueCacheMaxPayloadLength)
+  {
+    if (_enableDebugMessages)
+      Serial.printf("MQTT! [%s] is too long for the last value cache, skipping.\n", topic);
+    return;
+  }
+
+  // New topic, we take a free entry or the least recently used one
+  if (entry == NULL)
+  {
+    entry = &_lastValueCacheEntries[0];
+    for (uint8_t i = 0; i < _lastValueCacheCapacity && entry->generation != 0; i++)
+    {
+      if (_lastValueCacheEntries[i].generation == 0 || _lastValueCacheEntries[i].lastUsed < entry->lastUsed)
+        entry = &_lastValueCacheEntries[i];
+    }
+
+    entry->topicHash = topicHash;
+    entry->topicLength = topicLength;
+    memcpy(getLastValueCacheTopic(entry), topic, topicLength + 1);
+  }
+
+  char* entryPayload = getLastValueCachePayload(entry);
+  memcpy(entryPayload, payload, length);
+  entryPayload[length] = '\0';
+  entry->payloadLength = length;
+  entry->lastUsed = ++_lastValueCacheClock;
+  entry->generation = ++_lastValueCacheGeneration;
+}
+
+// ================== Report by exception ====================
+
+char* EspMQTTClient::getReportByExceptionTopic(const ReportByExceptionRecord* record)
+{
+  return _reportByExceptionTopics + (record - _reportByExceptionTable) * (_reportByExceptionMaxTopicLength + 1);
+}
+
+// Return the record of a topic. If create is true, a free record is taken, or the least recently used one
+// without deadband is evicted (e.g. a topic published only once). NULL if there is none, or if the topic is too long.
+EspMQTTClient::ReportByExceptionRecord* EspMQTTClient::findReportByExceptionRecord(const char* topic, bool create)
+{
+  unsigned int topicLength = strlen(topic);
+  if (topicLength > _reportByExceptionMaxTopicLength)
+    return NULL;
+
+  uint32_t topicHash = fnv1aHash((const uint8_t*)topic, topicLength);
+  ReportByExceptionRecord* freeRecord = NULL;
+
+  for (uint8_t i = 0; i < _reportByExceptionCapacity; i++)
+  {
+    ReportByExceptionRecord* record = &_reportByExceptionTable[i];
+    if (record->used && record->topicHash == topicHash && strcmp(getReportByExceptionTopic(record), topic) == 0)
+    {
+      record->lastUsed = ++_reportByExceptionClock;
+      return record;
+    }
+
+    bool evictable = !record->used || (record->deadbandAbsolute <= 0 && record->deadbandPercent <= 0);
+    if (evictable && (freeRecord == NULL || (freeRecord->used && (!record->used || record->lastUsed < freeRecord->lastUsed))))
+      freeRecord = record;
+  }
+
+  if (!create || freeRecord == NULL)
+    return NULL;
+
+  freeRecord->used = true;
+  memcpy(getReportByExceptionTopic(freeRecord), topic, topicLength + 1);
+  freeRecord->topicHash = topicHash;
+  freeRecord->published = false;
+  freeRecord->deadbandAbsolute = 0;
+  freeRecord->deadbandPercent = 0;
+  freeRecord->lastUsed = ++_reportByExceptionClock;
+  return freeRecord;
+}
+
+bool EspMQTTClient::isReportNeeded(const ReportByExceptionRecord &record, const uint8_t* payload, unsigned int plength)
+{
+  if (!record.published || millis() - record.lastPublishMillis >= _reportByExceptionHeartbeat)
+    return true;
+
+  // With a deadband, a numeric value is compared with the last published one
+  float value;
+  if ((record.deadbandAbsolute > 0 || record.deadbandPercent > 0) && record.numeric && EspMQTTPayload::parseFloat((const char*)payload, plength, value))
+  {
+    float difference = fabs(value - record.lastValue);
+    return difference > record.deadbandAbsolute && difference > fabs(record.lastValue) * record.deadbandPercent / 100;
+  }
+
+  return fnv1aHash(payload, plength) != record.payloadHash;
+}
+
+void EspMQTTClient::updateReportByExceptionRecord(ReportByExceptionRecord &record, const uint8_t* payload, unsigned int plength)
+{
+  record.payloadHash = fnv1aHash(payload, plength);
+  record.numeric = EspMQTTPayload::parseFloat((const char*)payload, plength, record.lastValue);
+  record.lastPublishMillis = millis();
+  record.published = true;
+}
+
+// Send the messages waiting for the rate limits, in order.
+void EspMQTTClient::processPublishQueue()
+{
+  while (!_publishQueue.empty() && isConnected())
+  {
+    QueuedPublishRecord &message = _publishQueue.front();
+    PublishRateLimitRecord* topicLimit = findPublishRateLimit(message.topic.c_str());
+
+    refillPublishRateLimit(_globalPublishRateLimit);
+    if (topicLimit != NULL)
+      refillPublishRateLimit(*topicLimit);
+
+    if (!hasPublishTokens(_globalPublishRateLimit, message.payload.size()) || (topicLimit != NULL && !hasPublishTokens(*topicLimit, message.payload.size())))
+      return;
+
+    consumePublishTokens(_globalPublishRateLimit, message.payload.size());
+    if (topicLimit != NULL)
+      consumePublishTokens(*topicLimit, message.payload.size());
+
+    if (publishToBroker(message.topic.c_str(), message.payload.data(), message.payload.size(), message.retain))
+      _publishRateLimitCounters.sentFromQueue++;
+    else if (!_mqttClient.connected())
+      return; // Kept for the next connection
+    else
+      _publishRateLimitCounters.failedFromQueue++;
+
+    _publishQueue.erase(_publishQueue.begin());
+  }
+}
+
+// Return the first rate limit matching the topic prefix, NULL if there is none
+EspMQTTClient::PublishRateLimitRecord* EspMQTTClient::findPublishRateLimit(const char* topic)
+{
+  for (std::size_t i = 0; i < _topicPublishRateLimitList.size(); i++)
+  {
+    const String &prefix = _topicPublishRateLimitList[i].topicPrefix;
+    if (strncmp(topic, prefix.c_str(), prefix.length()) == 0)
+      return &_topicPublishRateLimitList[i];
+  }
+  return NULL;
+}
+
+// Token buckets hold at most one second of traffic
+void EspMQTTClient::refillPublishRateLimit(PublishRateLimitRecord &limit)
+{
+  unsigned long currentMillis = millis();
+  float elapsedSeconds = (currentMillis - limit.lastRefillMillis) / 1000.0f;
+  limit.lastRefillMillis = currentMillis;
+
+  limit.messageTokens = std::min(limit.messagesPerSecond, limit.messageTokens + limit.messagesPerSecond * elapsedSeconds);
+  limit.byteTokens = std::min(limit.bytesPerSecond, limit.byteTokens + limit.bytesPerSecond * elapsedSeconds);
+}
+
+// A message bigger than the bucket can be sent when the bucket is full, the bucket then goes in debt
+bool EspMQTTClient::hasPublishTokens(const PublishRateLimitRecord &limit, unsigned int plength)
+{
+  bool messageAllowed = (limit.messagesPerSecond <= 0 || limit.messageTokens >= 1 || limit.messageTokens >= limit.messagesPerSecond);
+  bool bytesAllowed = (limit.bytesPerSecond <= 0 || limit.byteTokens >= plength || limit.byteTokens >= limit.bytesPerSecond);
+  return messageAllowed && bytesAllowed;
+}
+
+void EspMQTTClient::consumePublishTokens(PublishRateLimitRecord &limit, unsigned int plength)
+{
+  if (limit.messagesPerSecond > 0)
+    limit.messageTokens -= 1;
+  if (limit.bytesPerSecond > 0)
+    limit.byteTokens -= plength;
+}
+
+// Duty cycle handling.
+// Go to sleep once everything is done, or when we are awake for too long.
+void EspMQTTClient::handleDutyCycle()
+{
+  bool idle = _mqttConnected && _connectionEstablishedCount > 0 && _delayedExecutionList.empty() && _publishQueue.empty() && getPendingCallCount() == 0;
+
+  if (!idle)
+    _dutyCycleSleepMillis = 0;
+
+  // Keep the connection open a little to let the last publishes reach the broker
+  else if (_dutyCycleSleepMillis == 0)
+    _dutyCycleSleepMillis = millis() + _dutyCycleFlushDelay;
+
+  else if (millis() >= _dutyCycleSleepMillis)
+    sleep(_dutyCycleSleepSeconds);
+
+  if (_dutyCycleMaxAwakeMillis > 0 && millis() >= _dutyCycleMaxAwakeMillis)
+  {
+    if (_enableDebugMessages)
+      Serial.println("SYS! Maximum awake time reached, going in deep sleep anyway.");
+
+    sleep(_dutyCycleSleepSeconds);
+  }
 }
 
 void EspMQTTClient::mqttMessageReceivedCallback(char* topic, uint8_t* payload, unsigned int length)
 {
+  unsigned int topicLength = strlen(topic);
+
+  // When the inbound queue is enabled, the message is copied and will be dispatched after the reception.
+  if (_inboundQueueCapacity > 0 && _inboundQueueCount < _inboundQueueCapacity)
+  {
+    if (topicLength + length + 2 <= _inboundQueueEntrySize)
+    {
+      uint8_t* entry = _inboundQueueBuffer + _inboundQueueCount * _inboundQueueEntrySize;
+      memcpy(entry, topic, topicLength + 1);
+      memcpy(entry + topicLength + 1, payload, length);
+      entry[topicLength + 1 + length] = '\0';
+      _inboundQueuePayloadLengths[_inboundQueueCount] = length;
+      _inboundQueueCount++;
+    }
+    else
+    {
+      // A message that does not fit in a queue entry is copied aside and ends the reception,
+      // it is dispatched after the queued ones to keep the order of the messages
+      if (_enableDebugMessages)
+        Serial.print("MQTT! Message too long for the inbound queue, please set enableInboundQueue() with a higher maxMessageSize.\n");
+
+      _inboundOverflowMessage.assign(topic, topic + topicLength + 1);
+      _inboundOverflowMessage.insert(_inboundOverflowMessage.end(), payload, payload + length);
+      _inboundOverflowMessage.push_back('\0');
+      _inboundOverflowPayloadLength = length;
+    }
+    return;
+  }
+
   // Convert the payload into a String
   // First, We ensure that we dont bypass the maximum size of the PubSubClient library buffer that originated the payload
   // This buffer has a maximum length of _mqttClient.getBufferSize() and the payload begin at "headerSize + topicLength + 1"
   unsigned int strTerminationPos;
-  if (strlen(topic) + length + 9 >= _mqttClient.getBufferSize())
+  if (topicLength + length + 9 >= _mqttClient.getBufferSize())
   {
     strTerminationPos = length - 1;
 
@@ -732,20 +2140,82 @@ void EspMQTTClient::mqttMessageReceivedCallback(char* topic, uint8_t* payload, u
   else
     strTerminationPos = length;
 
-  // Second, we add the string termination code at the end of the payload and we convert it to a String object
+  // Second, we add the string termination code at the end of the payload
   payload[strTerminationPos] = '\0';
-  String payloadStr((char*)payload);
-  String topicStr(topic);
+
+  dispatchMqttMessage(topic, (char*)payload, strTerminationPos);
+}
+
+// Receive many messages in the same loop() call, bounded by the queue capacity and _inboundQueueMaxMillis.
+// Callbacks are called once the reception is done, so they can safely use publish().
+void EspMQTTClient::receiveInboundMessages()
+{
+  unsigned long startMillis = millis();
+
+  // PubSubClient process at most one packet per loop() call, we call it again while there is data waiting
+  _inboundQueueCount = 0;
+  do
+  {
+    ESP_MQTT_TRACE_SCOPE("mqttClient.loop");
+    _mqttClient.loop();
+  }
+  while (_inboundQueueCount < _inboundQueueCapacity && _inboundOverflowMessage.empty() && _transportClient->available() > 0 && millis() - startMillis < _inboundQueueMaxMillis);
+
+  // The queue is marked as full during the dispatch, a reception triggered by a callback is dispatched right away
+  uint8_t count = _inboundQueueCount;
+  _inboundQueueCount = _inboundQueueCapacity;
+
+  for (uint8_t i = 0; i < count; i++)
+  {
+    const char* entry = (const char*)_inboundQueueBuffer + i * _inboundQueueEntrySize;
+    dispatchMqttMessage(entry, entry + strlen(entry) + 1, _inboundQueuePayloadLengths[i]);
+  }
+
+  if (!_inboundOverflowMessage.empty())
+  {
+    const char* message = (const char*)_inboundOverflowMessage.data();
+    dispatchMqttMessage(message, message + strlen(message) + 1, _inboundOverflowPayloadLength);
+    _inboundOverflowMessage.clear();
+  }
+
+  _inboundQueueCount = 0;
+}
+
+// Send a message to the subscribers, topic and payload must be null terminated
+void EspMQTTClient::dispatchMqttMessage(const char* topic, const char* payload, unsigned int length)
+{
+  ESP_MQTT_TRACE_SCOPE("messageReceived");
 
   // Logging
   if (_enableDebugMessages)
-    Serial.printf("MQTT >> [%s] %s\n", topic, payloadStr.c_str());
+    Serial.printf("MQTT >> [%s] %s\n", topic, payload);
+
+  // The topic is split in levels once, for all the filters
+  _receivedTopic.parse(topic);
+
+  if (_lastValueCacheCapacity > 0)
+    updateLastValueCache(topic, payload, length);
+
+  // The Strings are built only if a subscriber need them
+  String payloadStr;
+  String topicStr;
+  bool stringsBuilt = false;
 
   // Send the message to subscribers
   for (std::size_t i = 0 ; i < _topicSubscriptionList.size() ; i++)
   {
-    if (mqttTopicMatch(_topicSubscriptionList[i].topic, String(topic)))
+    if (_topicSubscriptionList[i].filter.matches(_topicSubscriptionList[i].topic.c_str(), _receivedTopic))
     {
+      if(_topicSubscriptionList[i].rawCallback != NULL)
+        _topicSubscriptionList[i].rawCallback(payload, length); // Call the callback
+
+      if(!stringsBuilt && (_topicSubscriptionList[i].callback != NULL || _topicSubscriptionList[i].callbackWithTopic != NULL))
+      {
+        payloadStr = payload;
+        topicStr = topic;
+        stringsBuilt = true;
+      }
+
       if(_topicSubscriptionList[i].callback != NULL)
         _topicSubscriptionList[i].callback(payloadStr); // Call the callback
       if(_topicSubscriptionList[i].callbackWithTopic != NULL)
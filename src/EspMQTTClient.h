@@ -1,31 +1,56 @@
 #ifndef ESP_MQTT_CLIENT_H
 #define ESP_MQTT_CLIENT_H
 
-#include <ArduinoOTA.h>
+/*
+  Optional features can be removed from the binary with these build flags:
+    ESP_MQTT_CLIENT_DISABLE_OTA          : removes ArduinoOTA (enableOTA())
+    ESP_MQTT_CLIENT_DISABLE_WEB_UPDATER  : removes the web server, mDNS and the HTTP updater (enableHTTPWebUpdater())
+  And added with these ones:
+    ESP_MQTT_CLIENT_ENABLE_TRACING       : records the time spent in the hot paths, see EspMQTTTrace.h
+    ESP_MQTT_CLIENT_ENABLE_CAPTURE       : records the MQTT packets exchanged with the broker, see EspMQTTCapture.h
+  They must be set for the whole build (e.g. build_flags in platformio.ini), not with a #define in the sketch,
+  as they change the layout of the class.
+*/
+
+#ifndef ESP_MQTT_CLIENT_DISABLE_OTA
+  #include <ArduinoOTA.h>
+#endif
 #include <PubSubClient.h>
 #include <vector>
+#include "EspMQTTTrace.h"
+#include "EspMQTTCapture.h"
+#include "EspMQTTTopicFilter.h"
+#include "EspMQTTPayload.h"
 
 #ifdef ESP8266
 
   #include <ESP8266WiFi.h>
-  #include <ESP8266WebServer.h>
-  #include <ESP8266mDNS.h>
-  #include <ESP8266HTTPUpdateServer.h>
+  #ifndef ESP_MQTT_CLIENT_DISABLE_WEB_UPDATER
+    #include <ESP8266WebServer.h>
+    #include <ESP8266mDNS.h>
+    #include <ESP8266HTTPUpdateServer.h>
+
+    #define ESPHTTPUpdateServer ESP8266HTTPUpdateServer
+    #define ESPmDNS ESP8266mDNS
+    #define WebServer ESP8266WebServer
+  #endif
 
   #define DEFAULT_MQTT_CLIENT_NAME "ESP8266"
-  #define ESPHTTPUpdateServer ESP8266HTTPUpdateServer
-  #define ESPmDNS ESP8266mDNS
-  #define WebServer ESP8266WebServer
 
 #else // for ESP32
 
+  #include <WiFi.h>
   #include <WiFiClient.h>
-  #include <WebServer.h>
-  #include <ESPmDNS.h>
-  #include "ESP32HTTPUpdateServer.h"
+  #include <WiFiClientSecure.h>
+  #ifndef ESP_MQTT_CLIENT_DISABLE_WEB_UPDATER
+    #include <WebServer.h>
+    #include <ESPmDNS.h>
+    #include "ESP32HTTPUpdateServer.h"
+
+    #define ESPHTTPUpdateServer ESP32HTTPUpdateServer
+  #endif
 
   #define DEFAULT_MQTT_CLIENT_NAME "ESP32"
-  #define ESPHTTPUpdateServer ESP32HTTPUpdateServer
 
 #endif
 
@@ -35,6 +60,48 @@ typedef std::function<void()> ConnectionEstablishedCallback;
 typedef std::function<void(const String &message)> MessageReceivedCallback;
 typedef std::function<void(const String &topicStr, const String &message)> MessageReceivedCallbackWithTopic;
 typedef std::function<void()> DelayedExecutionCallback;
+typedef std::function<void(bool success, const String &response)> RpcResponseCallback; // success is false on timeout
+
+// Typed callbacks, the payload is parsed without any allocation
+typedef std::function<void(long value)> IntMessageReceivedCallback;
+typedef std::function<void(float value)> FloatMessageReceivedCallback;
+typedef std::function<void(bool value)> BoolMessageReceivedCallback;
+typedef std::function<void(const char* payload, unsigned int length)> RawMessageReceivedCallback;
+
+// What to do with a publish when a rate limit is reached
+enum class PublishRateLimitMode
+{
+  Reject,  // publish() return false
+  Queue,   // The message is sent later, in order
+  Coalesce // Like Queue, but replace a queued message of the same topic
+};
+
+struct PublishRateLimitCounters
+{
+  unsigned long sent;          // Sent right away
+  unsigned long sentFromQueue;
+  unsigned long failedFromQueue; // Dropped from the queue because the broker refused them (e.g. too long)
+  unsigned long queued;
+  unsigned long coalesced;
+  unsigned long rejected;      // Rejected by the limit or because the queue was full
+};
+
+struct MqttServerStats
+{
+  unsigned long connectionCount;
+  unsigned long failedConnectionCount;
+  unsigned long disconnectedMillis; // Time spent disconnected while trying to connect to this broker
+  unsigned long lastRoundTripMillis; // Last measured TCP connection time, 0 if unreachable
+};
+
+struct StartupTimings
+{
+  unsigned long wifiMillis;       // From the boot (or the WiFi loss) to the WiFi connection
+  unsigned long mqttMillis;       // From the WiFi connection to the broker connection, 0 if the broker was not reachable
+  unsigned long webUpdaterMillis; // Time spent starting mDNS and the web updater
+  unsigned long otaMillis;        // Time spent starting ArduinoOTA
+  unsigned long totalMillis;      // From the boot (or the WiFi loss) to all the services started
+};
 
 class EspMQTTClient
 {
@@ -49,6 +116,54 @@ private:
   const char* _wifiSsid;
   const char* _wifiPassword;
   WiFiClient _wifiClient;
+  Client* _transportClient; // Used by _mqttClient, _wifiClient by default
+  #ifdef ESP_MQTT_CLIENT_ENABLE_CAPTURE
+    EspMQTTCaptureClient _captureClient; // Wrap the transport client once enableCapture() is called
+  #endif
+
+  // TLS related
+  WiFiClientSecure* _secureClient;
+  const char* _tlsFingerprint;
+  #ifndef ESP8266
+    // Set by enableTLS() when a fingerprint is given, so WiFiClientSecure::verify() is linked only when it is used
+    bool (EspMQTTClient::*_tlsConnectAndVerify)();
+  #endif
+  #ifdef ESP8266
+    BearSSL::Session* _tlsSession; // Kept across reconnections to resume the TLS session
+    BearSSL::X509List* _tlsTrustAnchors;
+  #endif
+
+  // Fast WiFi reconnection related
+  bool _wifiFastReconnect;
+  bool _wifiFastReconnectReuseIp;
+  bool _connectingToWifiWithHint; // True when the current attempt use the cached BSSID/channel
+  bool _wifiReusedIpLease; // True when the current connection reuse the cached IP lease
+  unsigned int _wifiFastConnectionTimeout;
+  unsigned int _mqttConnectionDelayAfterWifi; // Settle delay between the wifi connection and the first mqtt connection attempt
+  bool _firstMqttAttemptAfterWifi;
+  IPAddress _wifiStaticIp;
+  IPAddress _wifiStaticGateway;
+  IPAddress _wifiStaticSubnet;
+  IPAddress _wifiStaticDns;
+  unsigned long _firstPublishMillis;
+
+  // Persisted in RTC memory so it survive a reset or a deep sleep
+  struct RtcState {
+    uint32_t checksum;
+    uint8_t bssid[6];
+    uint8_t channel; // 0 when no connection hint is available
+    uint8_t reserved;
+    uint32_t localIp;
+    uint32_t gatewayIp;
+    uint32_t subnetMask;
+    uint32_t dnsIp;
+    uint16_t mqttConnectionDelayAfterWifi;
+    uint16_t reserved2;
+    uint32_t dutyCycleCount;
+    uint32_t lastAwakeMillis;
+  };
+  RtcState _rtcState;
+  bool _rtcStateLoaded; // Read from the RTC memory once, _rtcState is the reference afterwards
 
   // MQTT related
   bool _mqttConnected;
@@ -64,6 +179,26 @@ private:
   char* _mqttLastWillMessage;
   bool _mqttLastWillRetain;
   unsigned int _failedMQTTConnectionAttemptCount;
+  unsigned long _lastMqttConnectionDuration;
+
+  // Multiple brokers related, the first one is set by the constructor or setMqttServer()
+  struct MqttServerRecord {
+    const char* ip;
+    const char* username;
+    const char* password;
+    uint16_t port;
+    MqttServerStats stats;
+  };
+  std::vector<MqttServerRecord> _mqttServerList;
+  uint8_t _mqttServerIndex; // Selected broker, copied in _mqttServerIp, _mqttUsername, _mqttPassword and _mqttServerPort
+  uint8_t _mqttPreferredServerIndex; // Broker to fail back to: the first one, or the fastest with the latency selection
+  uint8_t _mqttFailoverCount; // Number of brokers tried in the current connection round
+  bool _mqttServerLatencySelection;
+  bool _mqttFailingBack;
+  unsigned int _mqttFailoverDelay;
+  unsigned long _mqttFailbackDelay;
+  unsigned long _mqttConnectedSinceMillis;
+  unsigned long _mqttDisconnectedSinceMillis;
 
   PubSubClient _mqttClient;
 
@@ -71,16 +206,119 @@ private:
     String topic;
     MessageReceivedCallback callback;
     MessageReceivedCallbackWithTopic callbackWithTopic;
+    RawMessageReceivedCallback rawCallback;
+    EspMQTTTopicFilter filter; // Compiled from topic
   };
   std::vector<TopicSubscriptionRecord> _topicSubscriptionList;
+  EspMQTTTopicFilter::Topic _receivedTopic; // Levels of the message being dispatched
+
+  // Inbound queue related, messages are copied out of the PubSubClient buffer and dispatched after the reception
+  uint8_t* _inboundQueueBuffer; // _inboundQueueCapacity entries of _inboundQueueEntrySize bytes, each one is "topic\0payload\0"
+  uint16_t* _inboundQueuePayloadLengths;
+  uint8_t _inboundQueueCapacity;
+  uint8_t _inboundQueueCount;
+  uint16_t _inboundQueueEntrySize;
+  unsigned int _inboundQueueMaxMillis;
+  std::vector<uint8_t> _inboundOverflowMessage; // "topic\0payload\0" of a message too long for an entry, it ends the reception
+  unsigned int _inboundOverflowPayloadLength;
+
+  // Report by exception related, the table is allocated by enableReportByException()
+  struct ReportByExceptionRecord {
+    uint32_t topicHash;
+    uint32_t payloadHash;
+    float lastValue;
+    float deadbandAbsolute;
+    float deadbandPercent;
+    unsigned long lastPublishMillis;
+    uint32_t lastUsed; // Records without deadband are evicted least recently used first
+    bool used;
+    bool published;
+    bool numeric; // lastValue is valid
+  };
+  ReportByExceptionRecord* _reportByExceptionTable;
+  char* _reportByExceptionTopics; // One block of maxTopicLength + 1 chars per record
+  uint8_t _reportByExceptionCapacity;
+  uint8_t _reportByExceptionMaxTopicLength;
+  uint32_t _reportByExceptionClock;
+  unsigned long _reportByExceptionHeartbeat;
+  unsigned long _suppressedPublishCount;
+
+  // Publish rate limiting related (token buckets)
+  struct PublishRateLimitRecord {
+    String topicPrefix; // Empty for the global limit
+    float messagesPerSecond; // 0 for no limit
+    float bytesPerSecond; // 0 for no limit
+    float messageTokens;
+    float byteTokens;
+    unsigned long lastRefillMillis;
+    PublishRateLimitMode mode;
+  };
+  PublishRateLimitRecord _globalPublishRateLimit;
+  std::vector<PublishRateLimitRecord> _topicPublishRateLimitList;
+  struct QueuedPublishRecord {
+    String topic;
+    std::vector<uint8_t> payload;
+    bool retain;
+  };
+  std::vector<QueuedPublishRecord> _publishQueue;
+  uint8_t _publishQueueMaxSize;
+  PublishRateLimitCounters _publishRateLimitCounters;
+
+  // Last value cache related, all the entries are allocated by enableLastValueCache()
+  struct LastValueCacheEntry {
+    uint32_t topicHash;
+    uint32_t generation; // 0 when the entry is free
+    uint32_t lastUsed;
+    uint16_t payloadLength;
+    uint8_t topicLength;
+  };
+  LastValueCacheEntry* _lastValueCacheEntries;
+  char* _lastValueCacheData;
+  uint8_t _lastValueCacheCapacity;
+  uint8_t _lastValueCacheMaxTopicLength;
+  uint16_t _lastValueCacheMaxPayloadLength;
+  uint32_t _lastValueCacheClock;
+  uint32_t _lastValueCacheGeneration;
+  struct TopicFilterRecord {
+    String topic;
+    EspMQTTTopicFilter filter; // Compiled from topic
+  };
+  std::vector<TopicFilterRecord> _lastValueCacheFilterList;
+
+  // RPC related, the pending call table is allocated by enableRPC()
+  struct PendingRpcRecord {
+    uint16_t correlationId;
+    bool pending;
+    unsigned long startMillis;
+    unsigned long timeout;
+    RpcResponseCallback callback;
+  };
+  std::vector<PendingRpcRecord> _pendingRpcList;
+  String _rpcReplyTopic;
+  uint16_t _nextRpcCorrelationId;
 
   // HTTP/OTA update related
-  char* _updateServerAddress;
-  char* _updateServerUsername;
-  char* _updateServerPassword;
-  WebServer* _httpServer;
-  ESPHTTPUpdateServer* _httpUpdater;
-  bool _enableOTA;
+  #ifndef ESP_MQTT_CLIENT_DISABLE_WEB_UPDATER
+    char* _updateServerAddress;
+    char* _updateServerUsername;
+    char* _updateServerPassword;
+    WebServer* _httpServer;
+    ESPHTTPUpdateServer* _httpUpdater;
+    bool _httpUpdaterSetUp; // The updater routes are registered only once
+  #endif
+  #ifndef ESP_MQTT_CLIENT_DISABLE_OTA
+    bool _enableOTA;
+  #endif
+
+  // Staged startup related, the web updater and OTA are started after the broker connection, one per loop() call
+  enum class StartupStage : uint8_t { WiFi, Mqtt, WebUpdater, OTA, Done };
+  StartupStage _startupStage;
+  unsigned long _startupBeginMillis; // Boot or WiFi loss
+  unsigned long _startupStageBeginMillis;
+  unsigned int _servicesStartTimeout; // The services are started anyway when the broker is not reachable
+  StartupTimings _currentStartupTimings;
+  StartupTimings _bootTimings;
+  StartupTimings _reconnectionTimings;
 
   // Delayed execution related
   struct DelayedExecutionRecord {
@@ -95,6 +333,13 @@ private:
   bool _drasticResetOnConnectionFailures;
   unsigned int _connectionEstablishedCount; // Incremented before each _connectionEstablishedCallback call
 
+  // Duty cycle (publish and sleep) related
+  bool _dutyCycleEnabled;
+  unsigned long _dutyCycleSleepSeconds;
+  unsigned long _dutyCycleMaxAwakeMillis;
+  unsigned int _dutyCycleFlushDelay;
+  unsigned long _dutyCycleSleepMillis; // When the flush delay is over, 0 if not idle yet
+
 public:
   EspMQTTClient(
     // port and client name are swapped here to prevent a collision with the MQTT w/o auth constructor
@@ -137,12 +382,23 @@ public:
 
   // Optional functionality
   void enableDebuggingMessages(const bool enabled = true); // Allow to display useful debugging messages. Can be set to false to disable them during program execution
-  void enableHTTPWebUpdater(const char* username, const char* password, const char* address = "/"); // Activate the web updater, must be set before the first loop() call.
-  void enableHTTPWebUpdater(const char* address = "/"); // Will set user and password equal to _mqttUsername and _mqttPassword
-  void enableOTA(const char *password = NULL, const uint16_t port = 0); // Activate OTA updater, must be set before the first loop() call.
+  #ifndef ESP_MQTT_CLIENT_DISABLE_WEB_UPDATER
+    void enableHTTPWebUpdater(const char* username, const char* password, const char* address = "/"); // Activate the web updater, must be set before the first loop() call.
+    void enableHTTPWebUpdater(const char* address = "/"); // Will set user and password equal to _mqttUsername and _mqttPassword
+  #endif
+  #ifndef ESP_MQTT_CLIENT_DISABLE_OTA
+    void enableOTA(const char *password = NULL, const uint16_t port = 0); // Activate OTA updater, must be set before the first loop() call.
+  #endif
   void enableMQTTPersistence(); // Tell the broker to establish a persistent connection. Disabled by default. Must be called before the first loop() execution
   void enableLastWillMessage(const char* topic, const char* message, const bool retain = false); // Must be set before the first loop() call.
   void enableDrasticResetOnConnectionFailures() {_drasticResetOnConnectionFailures = true;} // Can be usefull in special cases where the ESP board hang and need resetting (#59)
+  void enableTLS(const char* fingerprint = NULL, const char* caCert = NULL); // Connect to the broker with TLS. Without fingerprint and CA certificate, the server is not authenticated. Must be set before the first loop() call.
+  void enableReportByException(const uint8_t maxTopics = 16, const unsigned long heartbeatMillis = 60 * 1000, const uint8_t maxTopicLength = 64); // Skip the publishes that repeat the last value of a topic, until heartbeatMillis is elapsed. Longer topics are always published. Must be set before the first loop() call.
+  void enableInboundQueue(const uint8_t maxMessagesPerLoop = 8, const uint16_t maxMessageSize = 256, const unsigned int maxMillisPerLoop = 20); // Receive many messages per loop() call and call the callbacks outside of the PubSubClient buffer. Must be set before the first loop() call.
+  void enableLastValueCache(const uint8_t maxEntries = 16, const uint8_t maxTopicLength = 64, const uint16_t maxPayloadLength = 64); // Keep the last message of the topics matching the cache filters. Must be set before the first loop() call.
+  void enableRPC(const String &replyTopic, const uint8_t maxPendingCalls = 8); // Replies are expected on "replyTopic/<correlation id>". Must be set before the first loop() call.
+  void enableDutyCycle(const unsigned long sleepSeconds, const unsigned long maxAwakeMillis = 10 * 1000); // Go in deep sleep once onConnectionEstablished has been called and there is nothing left to do. Must be set before the first loop() call.
+  void enableWifiFastReconnect(const bool reuseIpLease = false); // Remember the last BSSID/channel (and optionally the IP lease) in RTC memory to skip the scan (and DHCP) on the next connection. Must be set before the first loop() call.
 
   /// Main loop, to call at each sketch loop()
   void loop();
@@ -152,32 +408,76 @@ public:
 
   bool publish(const char* topic, const uint8_t* payload, unsigned int plenght, bool retain);
   bool publish(const String &topic, const String &payload, bool retain = false);
+  void setPublishDeadband(const String &topic, const float absolute, const float percent = 0); // With report by exception, a numeric value is unchanged while it stays within the deadband
+  inline unsigned long getSuppressedPublishCount() const { return _suppressedPublishCount; }; // Number of publishes skipped by the report by exception
+  void setPublishRateLimit(const float messagesPerSecond, const unsigned long bytesPerSecond = 0, const PublishRateLimitMode mode = PublishRateLimitMode::Queue); // Global limit, 0 for no limit
+  void setPublishRateLimit(const String &topicPrefix, const float messagesPerSecond, const unsigned long bytesPerSecond = 0, const PublishRateLimitMode mode = PublishRateLimitMode::Queue); // Limit for the topics starting with topicPrefix
+  inline void setPublishQueueSize(const uint8_t size) { _publishQueueMaxSize = size; }; // Maximum count of messages waiting for the rate limits, 10 by default
+  inline const PublishRateLimitCounters& getPublishRateLimitCounters() const { return _publishRateLimitCounters; };
   bool subscribe(const String &topic, MessageReceivedCallback messageReceivedCallback, uint8_t qos = 0);
   bool subscribe(const String &topic, MessageReceivedCallbackWithTopic messageReceivedCallback, uint8_t qos = 0);
   bool unsubscribe(const String &topic);   //Unsubscribes from the topic, if it exists, and removes it from the CallbackList.
+
+  // Request/response over MQTT, see enableRPC(). The request is published on "requestTopic/<correlation id>".
+  bool call(const String &requestTopic, const String &payload, RpcResponseCallback callback, const unsigned long timeout = 5 * 1000);
+  unsigned int getPendingCallCount() const;
+
+  // Last value cache, see enableLastValueCache()
+  void addLastValueCacheFilter(const String &topicFilter); // Cache the messages matching this filter (wildcards allowed). A subscription is still needed.
+  const char* getLastValue(const char* topic, unsigned int* length = NULL, uint32_t* generation = NULL); // Return NULL if the topic is not in the cache. Valid until the next loop() call.
+  uint32_t getLastValueGeneration(const char* topic); // Change at each new message on the topic, 0 if the topic is not in the cache
+
+  // Typed subscriptions, the callback is called only if the payload can be parsed.
+  bool subscribeRaw(const String &topic, RawMessageReceivedCallback messageReceivedCallback, uint8_t qos = 0); // Payload bytes, valid only during the callback
+  bool subscribeInt(const String &topic, IntMessageReceivedCallback messageReceivedCallback, uint8_t qos = 0);
+  bool subscribeFloat(const String &topic, FloatMessageReceivedCallback messageReceivedCallback, uint8_t qos = 0);
+  bool subscribeBool(const String &topic, BoolMessageReceivedCallback messageReceivedCallback, uint8_t qos = 0); // Accept true/false, on/off and 1/0
+  bool subscribeEnum(const String &topic, const char* const* values, const uint8_t valueCount, IntMessageReceivedCallback messageReceivedCallback, uint8_t qos = 0); // The callback receive the index of the matching value
+  bool subscribeJsonInt(const String &topic, const char* key, IntMessageReceivedCallback messageReceivedCallback, uint8_t qos = 0); // Value of a key of a flat JSON object
+  bool subscribeJsonFloat(const String &topic, const char* key, FloatMessageReceivedCallback messageReceivedCallback, uint8_t qos = 0);
+  bool subscribeJsonBool(const String &topic, const char* key, BoolMessageReceivedCallback messageReceivedCallback, uint8_t qos = 0);
   void setKeepAlive(uint16_t keepAliveSeconds); // Change the keepalive interval (15 seconds by default)
+  void setTransportClient(Client &client); // Allow to use another transport than the default WiFiClient (must be done in setup())
+  void setTLSBufferSizes(const int receiveSize, const int transmitSize); // ESP8266 only, change the TLS record buffer sizes. Must be called after enableTLS().
   inline void setMqttClientName(const char* name) { _mqttClientName = name; }; // Allow to set client name manually (must be done in setup(), else it will not work.)
-  inline void setMqttServer(const char* server, const char* username = "", const char* password = "", const uint16_t port = 1883) { // Allow setting the MQTT info manually (must be done in setup())
-    _mqttServerIp   = server;
-    _mqttUsername   = username;
-    _mqttPassword   = password;
-    _mqttServerPort = port;
-  };
+  void setMqttServer(const char* server, const char* username = "", const char* password = "", const uint16_t port = 1883); // Allow setting the MQTT info manually (must be done in setup())
+  void addMqttServer(const char* server, const char* username = "", const char* password = "", const uint16_t port = 1883); // Add a fallback broker, tried in order when the previous one fails (must be done in setup())
+  void enableMqttServerLatencySelection(const bool enabled = true); // Before each connection round, select the broker with the lowest TCP connection time
 
   // Wifi related
   void setWifiCredentials(const char* wifiSsid, const char* wifiPassword);
+  void setWifiStaticIp(const IPAddress &ip, const IPAddress &gateway, const IPAddress &subnet, const IPAddress &dns = IPAddress()); // Skip DHCP. Must be set before the first loop() call.
 
   // Other
   void executeDelayed(const unsigned long delay, DelayedExecutionCallback callback);
+  void sleep(const unsigned long seconds); // Cleanly disconnect from the broker and wifi, then go in deep sleep
+  #ifdef ESP_MQTT_CLIENT_ENABLE_TRACING
+    inline void dumpTrace(Print &output) { EspMQTTTrace::instance().dump(output); }; // Write the trace in the Chrome trace format, also available at /trace with the web updater
+  #endif
+  #ifdef ESP_MQTT_CLIENT_ENABLE_CAPTURE
+    void enableCapture(Print* output = NULL); // Record the MQTT packets in RAM, and to output if set (e.g. a file). Must be called in setup().
+    inline void dumpCapture(Print &output) { _captureClient.dump(output); }; // Write the RAM capture, also available at /capture with the web updater
+    inline void clearCapture() { _captureClient.clear(); };
+  #endif
+
+  inline unsigned long getDutyCycleCount() const { return _rtcState.dutyCycleCount; }; // Return the number of wake up since the first power up.
+  inline unsigned long getLastAwakeMillis() const { return _rtcState.lastAwakeMillis; }; // Return the time spent awake during the previous cycle.
 
   inline bool isConnected() const { return isWifiConnected() && isMqttConnected(); }; // Return true if everything is connected
   inline bool isWifiConnected() const { return _wifiConnected; }; // Return true if wifi is connected
   inline bool isMqttConnected() const { return _mqttConnected; }; // Return true if mqtt is connected
   inline unsigned int getConnectionEstablishedCount() const { return _connectionEstablishedCount; }; // Return the number of time onConnectionEstablished has been called since the beginning.
+  inline unsigned long getLastMqttConnectionDuration() const { return _lastMqttConnectionDuration; }; // Return the duration of the last broker connection, including the TLS handshake.
+  inline unsigned long getFirstPublishMillis() const { return _firstPublishMillis; }; // Return the time from boot to the first successful publish, 0 if nothing was published yet.
+  inline const StartupTimings& getBootTimings() const { return _bootTimings; }; // Return the time spent in each startup stage at boot, all 0 until the startup is completed.
+  inline const StartupTimings& getReconnectionTimings() const { return _reconnectionTimings; }; // Same, for the last WiFi reconnection.
 
   inline const char* getMqttClientName() { return _mqttClientName; };
   inline const char* getMqttServerIp() { return _mqttServerIp; };
   inline uint16_t getMqttServerPort() { return _mqttServerPort; };
+  inline uint8_t getMqttServerCount() const { return _mqttServerList.size(); };
+  inline uint8_t getMqttServerIndex() const { return _mqttServerIndex; }; // Index of the selected broker, 0 is the one set by the constructor or setMqttServer()
+  inline const MqttServerStats& getMqttServerStats(const uint8_t index) const { return _mqttServerList[index].stats; };
 
   // Default to onConnectionEstablished, you might want to override this for special cases like two MQTT connections in the same sketch
   inline void setOnConnectionEstablishedCallback(ConnectionEstablishedCallback callback) { _connectionEstablishedCallback = callback; };
@@ -185,9 +485,21 @@ public:
   // Allow to set the minimum delay between each MQTT reconnection attempt. 15 seconds by default.
   inline void setMqttReconnectionAttemptDelay(const unsigned int milliseconds) { _mqttReconnectionAttemptDelay = milliseconds; };
 
+  // Allow to set the delay before trying the next broker when a connection fails. 500 ms by default.
+  inline void setMqttFailoverDelay(const unsigned int milliseconds) { _mqttFailoverDelay = milliseconds; };
+
+  // Allow to set how long the connection to a fallback broker must be stable before going back to the first one. 5 minutes by default, 0 to disable.
+  inline void setMqttFailbackDelay(const unsigned long milliseconds) { _mqttFailbackDelay = milliseconds; };
+
   // Allow to set the minimum delay between each WiFi reconnection attempt. 60 seconds by default.
   inline void setWifiReconnectionAttemptDelay(const unsigned int milliseconds) { _wifiReconnectionAttemptDelay = milliseconds; };
 
+  // Allow to set the time during which the connection is kept open after the last publish, before going in deep sleep. 100 ms by default.
+  inline void setDutyCycleFlushDelay(const unsigned int milliseconds) { _dutyCycleFlushDelay = milliseconds; };
+
+  // Allow to set the maximum time allowed to a fast connection attempt (cached BSSID/channel) before falling back to a full scan. 3 seconds by default.
+  inline void setWifiFastConnectionTimeout(const unsigned int milliseconds) { _wifiFastConnectionTimeout = milliseconds; };
+
 private:
   bool handleWiFi();
   bool handleMQTT();
@@ -197,10 +509,44 @@ private:
   void onMQTTConnectionLost();
 
   void connectToWifi();
+  void saveWifiConnectionHint();
+  void clearWifiConnectionHint();
+  bool loadRtcState();
+  void saveRtcState();
   bool connectToMqttBroker();
+  void selectMqttServer(const uint8_t index);
+  void selectFastestMqttServer();
+  bool probeMqttServer(const uint8_t index);
   void processDelayedExecutionRequests();
-  bool mqttTopicMatch(const String &topic1, const String &topic2);
+  bool rateLimitAndPublish(const char* topic, const uint8_t* payload, unsigned int plength, bool retain);
+  char* getReportByExceptionTopic(const ReportByExceptionRecord* record);
+  ReportByExceptionRecord* findReportByExceptionRecord(const char* topic, bool create);
+  bool isReportNeeded(const ReportByExceptionRecord &record, const uint8_t* payload, unsigned int plength);
+  void updateReportByExceptionRecord(ReportByExceptionRecord &record, const uint8_t* payload, unsigned int plength);
+  bool publishToBroker(const char* topic, const uint8_t* payload, unsigned int plength, bool retain);
+  void processPublishQueue();
+  void onRpcReplyReceived(const String &topic, const String &payload);
+  void processRpcTimeouts();
+  char* getLastValueCacheTopic(const LastValueCacheEntry* entry);
+  char* getLastValueCachePayload(const LastValueCacheEntry* entry);
+  LastValueCacheEntry* findLastValueCacheEntry(const char* topic, uint32_t topicHash);
+  void updateLastValueCache(const char* topic, const char* payload, unsigned int length);
+  PublishRateLimitRecord* findPublishRateLimit(const char* topic);
+  static void refillPublishRateLimit(PublishRateLimitRecord &limit);
+  static bool hasPublishTokens(const PublishRateLimitRecord &limit, unsigned int plength);
+  static void consumePublishTokens(PublishRateLimitRecord &limit, unsigned int plength);
+  void handleDutyCycle();
+  void handleStartup();
+  #ifndef ESP8266
+    bool connectAndVerifyTlsServer();
+  #endif
+  #ifndef ESP_MQTT_CLIENT_DISABLE_WEB_UPDATER
+    bool authenticateWebRequest();
+  #endif
+
   void mqttMessageReceivedCallback(char* topic, uint8_t* payload, unsigned int length);
+  void receiveInboundMessages();
+  void dispatchMqttMessage(const char* topic, const char* payload, unsigned int length);
 };
 
 #endif
@@ -0,0 +1,268 @@
+#ifndef ESP_MQTT_PAYLOAD_H
+#define ESP_MQTT_PAYLOAD_H
+
+/*
+  Parsing of the MQTT payloads into native values, without any allocation.
+  The payload is parsed in place, it doesn't have to be null terminated.
+*/
+
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+
+class EspMQTTPayload
+{
+public:
+  // Remove the leading and trailing white spaces
+  static void trim(const char* &payload, unsigned int &length)
+  {
+    while (length > 0 && isspace((unsigned char)payload[0]))
+    {
+      payload++;
+      length--;
+    }
+    while (length > 0 && isspace((unsigned char)payload[length - 1]))
+      length--;
+  }
+
+  static bool parseInt(const char* payload, unsigned int length, long &value)
+  {
+    trim(payload, length);
+    const char* end = payload + length;
+
+    bool negative = (payload < end && *payload == '-');
+    if (payload < end && (*payload == '-' || *payload == '+'))
+      payload++;
+
+    if (payload == end)
+      return false;
+
+    // The magnitude is accumulated unsigned, a value out of the long range is rejected
+    unsigned long limit = negative ? (unsigned long)LONG_MAX + 1 : (unsigned long)LONG_MAX;
+    unsigned long magnitude = 0;
+    for (; payload < end; payload++)
+    {
+      if (!isdigit((unsigned char)*payload))
+        return false;
+
+      unsigned long digit = *payload - '0';
+      if (magnitude > (limit - digit) / 10)
+        return false;
+      magnitude = magnitude * 10 + digit;
+    }
+
+    if (negative)
+      value = (magnitude == limit) ? LONG_MIN : -(long)magnitude;
+    else
+      value = (long)magnitude;
+    return true;
+  }
+
+  static bool parseFloat(const char* payload, unsigned int length, float &value)
+  {
+    trim(payload, length);
+    const char* end = payload + length;
+
+    bool negative = (payload < end && *payload == '-');
+    if (payload < end && (*payload == '-' || *payload == '+'))
+      payload++;
+
+    double mantissa = 0;
+    int exponent = 0;
+    bool hasDigits = false;
+
+    // Past the precision of a double, the digits only move the exponent, so the mantissa stays finite
+    for (; payload < end && isdigit((unsigned char)*payload); payload++, hasDigits = true)
+    {
+      if (mantissa < 1e18)
+        mantissa = mantissa * 10 + (*payload - '0');
+      else
+        exponent++;
+    }
+
+    if (payload < end && *payload == '.')
+    {
+      for (payload++; payload < end && isdigit((unsigned char)*payload); payload++, hasDigits = true)
+      {
+        if (mantissa < 1e18)
+        {
+          mantissa = mantissa * 10 + (*payload - '0');
+          exponent--;
+        }
+      }
+    }
+
+    if (!hasDigits)
+      return false;
+
+    if (payload < end && (*payload == 'e' || *payload == 'E'))
+    {
+      payload++;
+      bool negativeExponent = (payload < end && *payload == '-');
+      if (payload < end && (*payload == '-' || *payload == '+'))
+        payload++;
+
+      if (payload == end)
+        return false;
+
+      // Far beyond the float range, bounded to avoid an overflow
+      int explicitExponent = 0;
+      for (; payload < end && isdigit((unsigned char)*payload); payload++)
+      {
+        explicitExponent = explicitExponent * 10 + (*payload - '0');
+        if (explicitExponent > 9999)
+          return false;
+      }
+      exponent += negativeExponent ? -explicitExponent : explicitExponent;
+    }
+
+    if (payload != end)
+      return false;
+
+    double result = mantissa == 0 ? 0 : (negative ? -mantissa : mantissa) * pow(10, exponent);
+    if (!isfinite(result) || fabs(result) > 3.402823466e+38) // FLT_MAX
+      return false;
+
+    value = (float)result;
+    return true;
+  }
+
+  static bool parseBool(const char* payload, unsigned int length, bool &value)
+  {
+    trim(payload, length);
+
+    if ((length == 4 && strncasecmp(payload, "true", 4) == 0) || (length == 2 && strncasecmp(payload, "on", 2) == 0) || (length == 1 && payload[0] == '1'))
+      value = true;
+    else if ((length == 5 && strncasecmp(payload, "false", 5) == 0) || (length == 3 && strncasecmp(payload, "off", 3) == 0) || (length == 1 && payload[0] == '0'))
+      value = false;
+    else
+      return false;
+
+    return true;
+  }
+
+  /**
+   * Find the value of a key in a flat JSON object, without any allocation.
+   * Nested objects and arrays are skipped. For strings, the value excludes the quotes and escapes are kept as is.
+   *
+   * @param value and valueLength are set to the value position in the json
+   * @return true if the key was found
+   */
+  static bool findJsonValue(const char* json, unsigned int length, const char* key, const char* &value, unsigned int &valueLength)
+  {
+    const char* end = json + length;
+    unsigned int keyLength = strlen(key);
+
+    while (json < end && isspace((unsigned char)*json))
+      json++;
+    if (json == end || *json != '{')
+      return false;
+    json++;
+
+    while (json < end)
+    {
+      // Key
+      while (json < end && (isspace((unsigned char)*json) || *json == ','))
+        json++;
+      if (json == end || *json != '"')
+        return false;
+
+      const char* keyBegin = json + 1;
+      if (!skipJsonString(json, end))
+        return false;
+      bool keyFound = ((unsigned int)(json - keyBegin - 1) == keyLength && strncmp(keyBegin, key, keyLength) == 0);
+
+      while (json < end && isspace((unsigned char)*json))
+        json++;
+      if (json == end || *json != ':')
+        return false;
+      json++;
+      while (json < end && isspace((unsigned char)*json))
+        json++;
+      if (json == end)
+        return false;
+
+      // Value
+      const char* valueBegin = json;
+      if (*json == '"')
+      {
+        if (!skipJsonString(json, end))
+          return false;
+
+        if (keyFound)
+        {
+          value = valueBegin + 1;
+          valueLength = json - valueBegin - 2;
+          return true;
+        }
+      }
+      else if (*json == '{' || *json == '[')
+      {
+        int depth = 0;
+        while (json < end)
+        {
+          if (*json == '"')
+          {
+            if (!skipJsonString(json, end))
+              return false;
+            continue;
+          }
+          if (*json == '{' || *json == '[')
+            depth++;
+          else if (*json == '}' || *json == ']')
+            depth--;
+          json++;
+          if (depth == 0)
+            break;
+        }
+
+        if (keyFound)
+        {
+          value = valueBegin;
+          valueLength = json - valueBegin;
+          return true;
+        }
+      }
+      else
+      {
+        while (json < end && *json != ',' && *json != '}' && !isspace((unsigned char)*json))
+          json++;
+
+        if (keyFound)
+        {
+          value = valueBegin;
+          valueLength = json - valueBegin;
+          return true;
+        }
+      }
+
+      while (json < end && isspace((unsigned char)*json))
+        json++;
+      if (json < end && *json == '}')
+        return false;
+    }
+
+    return false;
+  }
+
+private:
+  // Skip a JSON string, the position must be on the opening quote. Return false if the string is not terminated.
+  static bool skipJsonString(const char* &json, const char* end)
+  {
+    for (json++; json < end; json++)
+    {
+      if (*json == '\\')
+        json++;
+      else if (*json == '"')
+      {
+        json++;
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+#endif
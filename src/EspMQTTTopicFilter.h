@@ -0,0 +1,181 @@
+#ifndef ESP_MQTT_TOPIC_FILTER_H
+#define ESP_MQTT_TOPIC_FILTER_H
+
+/*
+  MQTT topic filters compiled once, at subscribe() time, into a table of levels.
+  A received topic is split in levels once, then compared level by level with each filter.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+class EspMQTTTopicFilter
+{
+public:
+  enum LevelType : uint8_t {
+    LITERAL,
+    SINGLE_LEVEL_WILDCARD, // +
+    MULTI_LEVEL_WILDCARD   // #
+  };
+
+  struct Level {
+    uint16_t offset;
+    uint16_t length;
+    uint32_t hash;
+    LevelType type;
+  };
+
+  // Levels of a received topic, reused from one message to the other to avoid allocations
+  class Topic
+  {
+  public:
+    const char* str;
+    std::vector<Level> levels;
+    bool system; // Topics starting with '$' are not matched by filters starting with a wildcard
+
+    void parse(const char* topic)
+    {
+      str = topic;
+      system = (topic[0] == '$');
+      levels.clear();
+      splitLevels(topic, strlen(topic), levels);
+    }
+  };
+
+private:
+  std::vector<Level> _levels;
+  bool _valid;
+
+public:
+  EspMQTTTopicFilter() : _valid(false) {}
+
+  /**
+   * Compile and validate a topic filter.
+   * '+' and '#' must occupy a whole level, and '#' must be the last level.
+   * For a shared subscription ("$share/<group>/<filter>" or "$queue/<filter>"), only <filter> is
+   * matched against the received topics.
+   *
+   * @return true if the filter is valid
+   */
+  bool compile(const char* filter, unsigned int length)
+  {
+    _levels.clear();
+    _valid = false;
+
+    int filterOffset = sharedSubscriptionFilterOffset(filter, length);
+    if (filterOffset < 0 || (unsigned int)filterOffset >= length)
+      return false;
+
+    splitLevels(filter + filterOffset, length - filterOffset, _levels);
+
+    for (std::size_t i = 0; i < _levels.size(); i++)
+      _levels[i].offset += filterOffset;
+
+    for (std::size_t i = 0; i < _levels.size(); i++)
+    {
+      Level &level = _levels[i];
+      const char* levelStr = filter + level.offset;
+
+      if (level.length == 1 && levelStr[0] == '+')
+        level.type = SINGLE_LEVEL_WILDCARD;
+      else if (level.length == 1 && levelStr[0] == '#')
+      {
+        if (i != _levels.size() - 1)
+          return false;
+        level.type = MULTI_LEVEL_WILDCARD;
+      }
+      else if (memchr(levelStr, '+', level.length) != NULL || memchr(levelStr, '#', level.length) != NULL)
+        return false;
+    }
+
+    _valid = true;
+    return true;
+  }
+
+  inline bool isValid() const { return _valid; }
+
+  /**
+   * @param filter the string that was compiled
+   * @param topic a received topic, must not contain wildcards
+   * @return true on MQTT topic match, false otherwise
+   */
+  bool matches(const char* filter, const Topic &topic) const
+  {
+    if (!_valid)
+      return false;
+
+    if (topic.system && _levels[0].type != LITERAL)
+      return false;
+
+    // Without '#', the level counts must be equal
+    bool multiLevel = (_levels.back().type == MULTI_LEVEL_WILDCARD);
+    if (!multiLevel && _levels.size() != topic.levels.size())
+      return false;
+
+    for (std::size_t i = 0; i < _levels.size(); i++)
+    {
+      const Level &level = _levels[i];
+
+      // '#' also match the parent level ("a/#" match "a")
+      if (level.type == MULTI_LEVEL_WILDCARD)
+        return true;
+
+      if (i >= topic.levels.size())
+        return false;
+
+      if (level.type == SINGLE_LEVEL_WILDCARD)
+        continue;
+
+      const Level &topicLevel = topic.levels[i];
+      if (level.length != topicLevel.length || level.hash != topicLevel.hash || memcmp(filter + level.offset, topic.str + topicLevel.offset, level.length) != 0)
+        return false;
+    }
+
+    return true;
+  }
+
+  /**
+   * @return the offset of <filter> in a shared subscription, 0 for a normal subscription, -1 if
+   * the share group name is empty or contains a wildcard
+   */
+  static int sharedSubscriptionFilterOffset(const char* filter, unsigned int length)
+  {
+    if (length >= 7 && strncmp(filter, "$queue/", 7) == 0)
+      return 7;
+
+    if (length < 7 || strncmp(filter, "$share/", 7) != 0)
+      return 0;
+
+    const char* group = filter + 7;
+    const char* groupEnd = (const char*)memchr(group, '/', length - 7);
+    if (groupEnd == NULL || groupEnd == group || memchr(group, '+', groupEnd - group) != NULL || memchr(group, '#', groupEnd - group) != NULL)
+      return -1;
+
+    return groupEnd + 1 - filter;
+  }
+
+private:
+  // Split on '/' and hash each level (FNV-1a). Empty levels are valid.
+  static void splitLevels(const char* str, unsigned int length, std::vector<Level> &levels)
+  {
+    Level level = { 0, 0, 2166136261u, LITERAL };
+
+    for (unsigned int i = 0; i < length; i++)
+    {
+      if (str[i] == '/')
+      {
+        level.length = i - level.offset;
+        levels.push_back(level);
+        level = { (uint16_t)(i + 1), 0, 2166136261u, LITERAL };
+      }
+      else
+        level.hash = (level.hash ^ (uint8_t)str[i]) * 16777619u;
+    }
+
+    level.length = length - level.offset;
+    levels.push_back(level);
+  }
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef ESP_MQTT_TRACE_H
+#define ESP_MQTT_TRACE_H
+
+/*
+  Lightweight execution tracing of the library hot paths.
+  Enabled with the ESP_MQTT_CLIENT_ENABLE_TRACING build flag, it compiles out entirely otherwise.
+  Each traced scope is recorded in a fixed RAM ring buffer, which can be dumped in the Chrome trace
+  format (chrome://tracing or https://ui.perfetto.dev).
+*/
+
+#ifdef ESP_MQTT_CLIENT_ENABLE_TRACING
+
+#include <Arduino.h>
+
+// Number of events kept in the ring buffer
+#ifndef ESP_MQTT_CLIENT_TRACE_SIZE
+  #define ESP_MQTT_CLIENT_TRACE_SIZE 128
+#endif
+
+class EspMQTTTrace
+{
+private:
+  struct Event {
+    const char* name; // Must be a string literal
+    uint32_t beginMicros;
+    uint32_t durationMicros;
+  };
+  Event _events[ESP_MQTT_CLIENT_TRACE_SIZE];
+  uint16_t _head;
+  uint16_t _count;
+
+  EspMQTTTrace() : _head(0), _count(0) {}
+
+public:
+  static EspMQTTTrace& instance()
+  {
+    static EspMQTTTrace trace;
+    return trace;
+  }
+
+  void record(const char* name, uint32_t beginMicros, uint32_t durationMicros)
+  {
+    _events[_head] = { name, beginMicros, durationMicros };
+    _head = (_head + 1) % ESP_MQTT_CLIENT_TRACE_SIZE;
+    if (_count < ESP_MQTT_CLIENT_TRACE_SIZE)
+      _count++;
+  }
+
+  // Write the events, oldest first, as Chrome trace JSON
+  void dump(Print &output)
+  {
+    output.print("{\"traceEvents\":[");
+
+    uint16_t index = (_head + ESP_MQTT_CLIENT_TRACE_SIZE - _count) % ESP_MQTT_CLIENT_TRACE_SIZE;
+    for (uint16_t i = 0; i < _count; i++)
+    {
+      const Event &event = _events[index];
+      output.printf("%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%u,\"dur\":%u,\"pid\":1,\"tid\":1}",
+        i > 0 ? "," : "", event.name, (unsigned int)event.beginMicros, (unsigned int)event.durationMicros);
+      index = (index + 1) % ESP_MQTT_CLIENT_TRACE_SIZE;
+    }
+
+    output.print("],\"displayTimeUnit\":\"ms\"}");
+  }
+
+  void clear()
+  {
+    _head = 0;
+    _count = 0;
+  }
+};
+
+// Record the time spent from its declaration to the end of the enclosing scope
+class EspMQTTTraceScope
+{
+private:
+  const char* _name;
+  uint32_t _beginMicros;
+
+public:
+  EspMQTTTraceScope(const char* name) : _name(name), _beginMicros(micros()) {}
+  ~EspMQTTTraceScope() { EspMQTTTrace::instance().record(_name, _beginMicros, micros() - _beginMicros); }
+};
+
+#define ESP_MQTT_TRACE_CONCAT_(a, b) a##b
+#define ESP_MQTT_TRACE_CONCAT(a, b) ESP_MQTT_TRACE_CONCAT_(a, b)
+#define ESP_MQTT_TRACE_SCOPE(name) EspMQTTTraceScope ESP_MQTT_TRACE_CONCAT(espMqttTraceScope, __LINE__)(name)
+
+#else
+
+#define ESP_MQTT_TRACE_SCOPE(name)
+
+#endif
+
+#endif
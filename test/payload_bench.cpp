@@ -0,0 +1,110 @@
+/*
+  Benchmark of the typed payload parsing of EspMQTTPayload against the String based path of a
+  typical callback: the payload copied into a heap string, then toInt() / toFloat() (atol / atof),
+  or indexOf() of the key in a JSON object. It runs on the host:
+
+    g++ -std=gnu++11 -O2 -I src test/payload_bench.cpp -o payload_bench && ./payload_bench [rounds]
+
+  The absolute figures are those of the host, only the ratio between both paths is meaningful.
+  std::string keeps short payloads inline while an Arduino String always allocates them, so the
+  String path is slower on the boards than here.
+*/
+
+#include "EspMQTTPayload.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+// Keep the results alive so the compiler can't drop the parsing
+static volatile double sink;
+
+template <typename Function>
+static double nanosecondsPerPayload(const std::vector<std::string> &payloads, long rounds, Function parse)
+{
+  double total = 0;
+  Clock::time_point start = Clock::now();
+  for (long round = 0; round < rounds; round++)
+    for (std::size_t i = 0; i < payloads.size(); i++)
+      total += parse(payloads[i].c_str(), payloads[i].size());
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  sink = total;
+  return seconds * 1e9 / ((double)rounds * payloads.size());
+}
+
+static void report(const char* name, double stringNanoseconds, double parserNanoseconds)
+{
+  printf("%-6s: String %7.1f ns, EspMQTTPayload %7.1f ns, speedup %5.2fx\n", name, stringNanoseconds, parserNanoseconds, stringNanoseconds / parserNanoseconds);
+}
+
+int main(int argc, char** argv)
+{
+  long rounds = argc > 1 ? atol(argv[1]) : 200000;
+
+  std::vector<std::string> ints = { "0", "1", "42", "-17", "255", "1024", "65535", "-2147483648", "86400", " 7 " };
+  std::vector<std::string> floats = { "21.5", "-3.25", "1013.25", "0.001", "45", "99.99", "-0.5", "1.5e3", "23.875", " 18.0\n" };
+  std::vector<std::string> bools = { "true", "false", "on", "off", "1", "0", "TRUE", "Off" };
+  std::vector<std::string> jsons = {
+    "{\"temperature\":21.5,\"humidity\":48,\"battery\":97}",
+    "{\"state\":\"ON\",\"brightness\":180,\"temperature\":19.25}",
+    "{\"linkquality\":120,\"temperature\": -4.5,\"voltage\":3000}",
+    "{\"Time\":\"2024-01-01T00:00:00\",\"ENERGY\":{\"Power\":12},\"temperature\":22.0}",
+  };
+
+  double stringNs = nanosecondsPerPayload(ints, rounds, [](const char* payload, unsigned int length) {
+    std::string str(payload, length);
+    return (double)atol(str.c_str());
+  });
+  double parserNs = nanosecondsPerPayload(ints, rounds, [](const char* payload, unsigned int length) {
+    long value = 0;
+    EspMQTTPayload::parseInt(payload, length, value);
+    return (double)value;
+  });
+  report("int", stringNs, parserNs);
+
+  stringNs = nanosecondsPerPayload(floats, rounds, [](const char* payload, unsigned int length) {
+    std::string str(payload, length);
+    return atof(str.c_str());
+  });
+  parserNs = nanosecondsPerPayload(floats, rounds, [](const char* payload, unsigned int length) {
+    float value = 0;
+    EspMQTTPayload::parseFloat(payload, length, value);
+    return (double)value;
+  });
+  report("float", stringNs, parserNs);
+
+  stringNs = nanosecondsPerPayload(bools, rounds, [](const char* payload, unsigned int length) {
+    std::string str(payload, length);
+    for (std::size_t i = 0; i < str.size(); i++)
+      str[i] = tolower(str[i]);
+    return (double)(str == "true" || str == "on" || str == "1");
+  });
+  parserNs = nanosecondsPerPayload(bools, rounds, [](const char* payload, unsigned int length) {
+    bool value = false;
+    EspMQTTPayload::parseBool(payload, length, value);
+    return (double)value;
+  });
+  report("bool", stringNs, parserNs);
+
+  stringNs = nanosecondsPerPayload(jsons, rounds, [](const char* payload, unsigned int length) {
+    std::string str(payload, length);
+    std::size_t position = str.find("\"temperature\"");
+    if (position == std::string::npos)
+      return 0.0;
+    position = str.find(':', position);
+    return atof(str.substr(position + 1).c_str());
+  });
+  parserNs = nanosecondsPerPayload(jsons, rounds, [](const char* payload, unsigned int length) {
+    float value = 0;
+    if (EspMQTTPayload::findJsonValue(payload, length, "temperature", payload, length))
+      EspMQTTPayload::parseFloat(payload, length, value);
+    return (double)value;
+  });
+  report("json", stringNs, parserNs);
+
+  return 0;
+}
@@ -0,0 +1,142 @@
+/*
+  Benchmark of EspMQTTTopicFilter against the string based matcher it replaced, over a realistic
+  set of subscriptions and received topics. Each received topic is matched against every filter,
+  as EspMQTTClient does for each message. It runs on the host:
+
+    g++ -std=gnu++11 -O2 -I src test/topic_filter_bench.cpp -o topic_filter_bench && ./topic_filter_bench [rounds]
+
+  The absolute figures are those of the host, only the ratio between both matchers is meaningful.
+*/
+
+#include "EspMQTTTopicFilter.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+// The previous matcher of EspMQTTClient, scanning both strings for each filter
+static bool stringTopicMatch(const std::string &topic1, const char* topic2)
+{
+  const char *topic1_p = topic1.c_str();
+  const char *topic1_end = topic1_p + topic1.size();
+  const char *topic2_p = topic2;
+  const char *topic2_end = topic2 + strlen(topic2);
+
+  while (topic1_p < topic1_end && topic2_p < topic2_end)
+  {
+    if (*topic1_p == '#')
+      return true;
+
+    if (*topic1_p == '+')
+    {
+      const char *temp = strchr(topic2_p, '/');
+      topic2_p = temp ? temp : topic2_end;
+      ++topic1_p;
+      continue;
+    }
+
+    const char* temp = strchr(topic1_p, '+');
+    int len = temp == NULL ? topic1_end - topic1_p : temp - topic1_p;
+    if (topic1_p[len - 1] == '#')
+      --len;
+
+    if (topic2_end - topic2_p < len)
+      return false;
+
+    if (strncmp(topic1_p, topic2_p, len))
+      return false;
+
+    topic1_p += len;
+    topic2_p += len;
+  }
+
+  return !(topic1_p < topic1_end || topic2_p < topic2_end);
+}
+
+int main(int argc, char** argv)
+{
+  long rounds = argc > 1 ? atol(argv[1]) : 20000;
+
+  // A home automation node: its own command topics, a few sensors of other rooms and some bridges
+  std::vector<std::string> filters = {
+    "home/livingroom/lamp/set",
+    "home/livingroom/lamp/brightness/set",
+    "home/livingroom/+/temperature",
+    "home/+/window/state",
+    "home/kitchen/#",
+    "home/garage/door/set",
+    "zigbee2mqtt/+/set",
+    "zigbee2mqtt/bridge/state",
+    "zigbee2mqtt/bridge/devices",
+    "shellies/+/relay/0/command",
+    "tele/+/SENSOR",
+    "stat/+/POWER",
+    "devices/esp-1a2b3c/config",
+    "devices/esp-1a2b3c/ota/#",
+    "backend/reply/esp-1a2b3c/+",
+    "$share/workers/jobs/#",
+    "alerts/#",
+    "weather/+/+/current",
+    "energy/meter/+/power",
+    "homeassistant/status",
+  };
+
+  std::vector<std::string> topics;
+  const char* rooms[] = { "livingroom", "kitchen", "bedroom", "garage", "office" };
+  const char* devices[] = { "lamp", "window", "thermostat", "plug", "door" };
+  const char* measures[] = { "temperature", "humidity", "state", "power", "set" };
+  for (int i = 0; i < 5; i++)
+    for (int j = 0; j < 5; j++)
+      for (int k = 0; k < 5; k++)
+        topics.push_back(std::string("home/") + rooms[i] + "/" + devices[j] + "/" + measures[k]);
+  for (int i = 0; i < 20; i++)
+  {
+    topics.push_back("zigbee2mqtt/0x00158d000" + std::to_string(100000 + i));
+    topics.push_back("zigbee2mqtt/0x00158d000" + std::to_string(100000 + i) + "/set");
+    topics.push_back("tele/tasmota_" + std::to_string(i) + "/SENSOR");
+    topics.push_back("stat/tasmota_" + std::to_string(i) + "/RESULT");
+  }
+  topics.push_back("zigbee2mqtt/bridge/state");
+  topics.push_back("devices/esp-1a2b3c/config");
+  topics.push_back("devices/esp-1a2b3c/ota/chunk/12");
+  topics.push_back("backend/reply/esp-1a2b3c/42");
+  topics.push_back("jobs/resize/1234");
+  topics.push_back("weather/paris/outside/current");
+  topics.push_back("energy/meter/main/power");
+  topics.push_back("homeassistant/status");
+  topics.push_back("$SYS/broker/uptime");
+
+  std::vector<EspMQTTTopicFilter> compiled(filters.size());
+  for (std::size_t i = 0; i < filters.size(); i++)
+    compiled[i].compile(filters[i].c_str(), filters[i].size());
+
+  typedef std::chrono::steady_clock Clock;
+  long stringMatches = 0, compiledMatches = 0;
+
+  Clock::time_point start = Clock::now();
+  for (long round = 0; round < rounds; round++)
+    for (std::size_t t = 0; t < topics.size(); t++)
+      for (std::size_t f = 0; f < filters.size(); f++)
+        stringMatches += stringTopicMatch(filters[f], topics[t].c_str());
+  double stringSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  EspMQTTTopicFilter::Topic received;
+  start = Clock::now();
+  for (long round = 0; round < rounds; round++)
+    for (std::size_t t = 0; t < topics.size(); t++)
+    {
+      received.parse(topics[t].c_str());
+      for (std::size_t f = 0; f < filters.size(); f++)
+        compiledMatches += compiled[f].matches(filters[f].c_str(), received);
+    }
+  double compiledSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  // The string matcher ignores the shared subscription prefix, so the match counts differ by design
+  double messages = (double)rounds * topics.size();
+  printf("%zu filters, %zu topics, %ld rounds\n", filters.size(), topics.size(), rounds);
+  printf("string matcher  : %8.1f ns per message, %ld matches\n", stringSeconds * 1e9 / messages, stringMatches);
+  printf("compiled matcher: %8.1f ns per message, %ld matches\n", compiledSeconds * 1e9 / messages, compiledMatches);
+  printf("speedup         : %8.2fx\n", stringSeconds / compiledSeconds);
+  return 0;
+}
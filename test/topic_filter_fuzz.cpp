@@ -0,0 +1,125 @@
+/*
+  Randomized differential test of EspMQTTTopicFilter against a straightforward reference matcher,
+  written from the MQTT specification. It runs on the host:
+
+    g++ -std=gnu++11 -O2 -I src test/topic_filter_fuzz.cpp -o topic_filter_fuzz && ./topic_filter_fuzz [iterations] [seed]
+*/
+
+#include "EspMQTTTopicFilter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+static std::vector<std::string> splitLevels(const std::string &str)
+{
+  std::vector<std::string> levels(1);
+  for (std::size_t i = 0; i < str.size(); i++)
+  {
+    if (str[i] == '/')
+      levels.push_back("");
+    else
+      levels.back() += str[i];
+  }
+  return levels;
+}
+
+// Return the position of the filter part of a shared subscription, 0 for a normal one, -1 if invalid
+static int referenceSharedOffset(const std::string &filter)
+{
+  if (filter.compare(0, 7, "$queue/") == 0)
+    return 7;
+  if (filter.compare(0, 7, "$share/") != 0)
+    return 0;
+
+  std::size_t groupEnd = filter.find('/', 7);
+  if (groupEnd == std::string::npos || groupEnd == 7 || filter.find_first_of("+#", 7) < groupEnd)
+    return -1;
+  return groupEnd + 1;
+}
+
+static bool referenceIsValid(const std::string &fullFilter)
+{
+  int offset = referenceSharedOffset(fullFilter);
+  if (offset < 0 || (std::size_t)offset >= fullFilter.size())
+    return false;
+
+  std::vector<std::string> levels = splitLevels(fullFilter.substr(offset));
+  for (std::size_t i = 0; i < levels.size(); i++)
+  {
+    const std::string &level = levels[i];
+    if (level == "#" && i != levels.size() - 1)
+      return false;
+    if (level != "+" && level != "#" && level.find_first_of("+#") != std::string::npos)
+      return false;
+  }
+  return true;
+}
+
+static bool referenceMatches(const std::string &fullFilter, const std::string &topic)
+{
+  if (!referenceIsValid(fullFilter))
+    return false;
+
+  std::vector<std::string> filterLevels = splitLevels(fullFilter.substr(referenceSharedOffset(fullFilter)));
+  std::vector<std::string> topicLevels = splitLevels(topic);
+
+  // Topics starting with '$' are not matched by a filter starting with a wildcard
+  if (!topic.empty() && topic[0] == '$' && (filterLevels[0] == "+" || filterLevels[0] == "#"))
+    return false;
+
+  for (std::size_t i = 0; i < filterLevels.size(); i++)
+  {
+    if (filterLevels[i] == "#")
+      return true;
+    if (i >= topicLevels.size())
+      return false;
+    if (filterLevels[i] != "+" && filterLevels[i] != topicLevels[i])
+      return false;
+  }
+  return filterLevels.size() == topicLevels.size();
+}
+
+static std::string randomString(const char* alphabet, int maxLength)
+{
+  std::string str;
+  int length = rand() % (maxLength + 1);
+  int alphabetLength = strlen(alphabet);
+  for (int i = 0; i < length; i++)
+    str += alphabet[rand() % alphabetLength];
+  return str;
+}
+
+int main(int argc, char** argv)
+{
+  long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+  srand(argc > 2 ? atoi(argv[2]) : 1);
+
+  static const char* prefixes[] = { "", "", "", "$SYS/", "$share/g/", "$share//", "$share/+/", "$share/g", "$queue/" };
+  long failures = 0;
+
+  for (long i = 0; i < iterations; i++)
+  {
+    std::string filter = std::string(prefixes[rand() % 9]) + randomString("ab/+#$", 8);
+    std::string topic = randomString("ab/$", 8);
+    // Make matching topics likely enough
+    if (rand() % 2)
+      topic = randomString("$", 1) + randomString("ab/", 6);
+
+    EspMQTTTopicFilter compiled;
+    bool valid = compiled.compile(filter.c_str(), filter.size());
+
+    EspMQTTTopicFilter::Topic parsedTopic;
+    parsedTopic.parse(topic.c_str());
+    bool match = compiled.matches(filter.c_str(), parsedTopic);
+
+    if (valid != referenceIsValid(filter) || match != referenceMatches(filter, topic))
+    {
+      if (failures++ < 20)
+        printf("MISMATCH filter \"%s\" topic \"%s\": valid %d match %d\n", filter.c_str(), topic.c_str(), valid, match);
+    }
+  }
+
+  printf("%ld iterations, %ld mismatches\n", iterations, failures);
+  return failures == 0 ? 0 : 1;
+}